@@ -1,18 +1,54 @@
 #include <iostream>
 #include <vector>
 #include <limits>
-#include <optional>
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <queue>
+#include <functional>
+#include <utility>
+#include <sstream>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <tuple>
+#include <list>
+#include <deque>
+#include <condition_variable>
+#include <future>
+#include <unordered_map>
+#include <sys/resource.h>
 
 constexpr size_t MAX_ENTRIES = 4;  
 constexpr size_t MIN_ENTRIES = 2; 
 
+class Point {
+public:
+    float x, y;
+
+    Point() = default;
+    Point(float x, float y) : x(x), y(y) {}
+
+    bool operator==(const Point& other) const {
+        return x == other.x && y == other.y;
+    }
+};
+
 class Rectangle {
 public:
     float x_min, y_min, x_max, y_max;
 
+    Rectangle() = default;
     Rectangle(float x_min, float y_min, float x_max, float y_max)
         : x_min(x_min), y_min(y_min), x_max(x_max), y_max(y_max) {}
 
@@ -20,11 +56,61 @@ public:
         return (x_max - x_min) * (y_max - y_min);
     }
 
+    float margin() const {
+        return 2.0f * ((x_max - x_min) + (y_max - y_min));
+    }
+
+    // Area of the intersection with `other`, zero when they are disjoint.
+    float overlapArea(const Rectangle& other) const {
+        float width = std::min(x_max, other.x_max) - std::max(x_min, other.x_min);
+        float height = std::min(y_max, other.y_max) - std::max(y_min, other.y_min);
+        return width > 0 && height > 0 ? width * height : 0.0f;
+    }
+
     bool overlaps(const Rectangle& other) const {
         return !(x_min >= other.x_max || x_max <= other.x_min ||
                  y_min >= other.y_max || y_max <= other.y_min);
     }
 
+    // Closed-interval variant of overlaps(). Internal nodes of a point tree
+    // can have degenerate boxes sitting exactly on the query edge, so descent
+    // has to treat touching boxes as intersecting.
+    bool intersects(const Rectangle& other) const {
+        return x_min <= other.x_max && x_max >= other.x_min &&
+               y_min <= other.y_max && y_max >= other.y_min;
+    }
+
+    bool contains(const Point& point) const {
+        return point.x >= x_min && point.x <= x_max &&
+               point.y >= y_min && point.y <= y_max;
+    }
+
+    bool contains(const Rectangle& other) const {
+        return other.x_min >= x_min && other.x_max <= x_max &&
+               other.y_min >= y_min && other.y_max <= y_max;
+    }
+
+    // Squared distance from `point` to the nearest point of the box; zero
+    // when the point is inside.
+    float minDistanceSquared(const Point& point) const {
+        float dx = std::max({x_min - point.x, 0.0f, point.x - x_max});
+        float dy = std::max({y_min - point.y, 0.0f, point.y - y_max});
+        return dx * dx + dy * dy;
+    }
+
+    // Squared distance between the closest points of the two boxes; zero
+    // when they intersect.
+    float minDistanceSquared(const Rectangle& other) const {
+        float dx = std::max({x_min - other.x_max, 0.0f, other.x_min - x_max});
+        float dy = std::max({y_min - other.y_max, 0.0f, other.y_min - y_max});
+        return dx * dx + dy * dy;
+    }
+
+    bool operator==(const Rectangle& other) const {
+        return x_min == other.x_min && y_min == other.y_min &&
+               x_max == other.x_max && y_max == other.y_max;
+    }
+
     void expand(const Rectangle& other) {
         x_min = std::min(x_min, other.x_min);
         y_min = std::min(y_min, other.y_min);
@@ -33,254 +119,6432 @@ public:
     }
 };
 
-template <typename DataT>
-struct Entry {
+// Leaf keys are either full rectangles or bare points. Internal nodes always
+// store rectangles, so every key type must be able to produce its bounds.
+inline Rectangle boundsOf(const Rectangle& rect) {
+    return rect;
+}
+
+inline Rectangle boundsOf(const Point& point) {
+    return Rectangle(point.x, point.y, point.x, point.y);
+}
+
+inline bool keyMatches(const Rectangle& key, const Rectangle& query) {
+    return key.overlaps(query);
+}
+
+inline bool keyMatches(const Point& key, const Rectangle& query) {
+    return query.contains(key);
+}
+
+// Node and payload indices are IndexT (uint32_t unless a tree asks for
+// more); the all-ones value is reserved to mean "no index".
+template <typename IndexT>
+constexpr IndexT INVALID_INDEX = std::numeric_limits<IndexT>::max();
+
+// Internal node record: a child pointer and the box covering that subtree.
+template <typename IndexT = uint32_t>
+struct BranchEntry {
     Rectangle bounding_box;
-    std::optional<DataT> data;
-    size_t child_index;
+    IndexT child_index;
 
-    Entry(const Rectangle& rect, const std::optional<DataT>& data = std::nullopt)
-        : bounding_box(rect), data(data), child_index(std::numeric_limits<size_t>::max()) {}
+    BranchEntry() = default;
+    BranchEntry(const Rectangle& rect, IndexT child_index)
+        : bounding_box(rect), child_index(child_index) {}
+
+    Rectangle bounds() const {
+        return bounding_box;
+    }
 };
 
-template <typename DataT>
+// Leaf record: the key plus an index into RTree::payloads. Payloads never
+// move during splits; only these small records do.
+template <typename KeyT = Rectangle, typename IndexT = uint32_t>
+struct LeafEntry {
+    KeyT key;
+    IndexT data_index;
+
+    LeafEntry() = default;
+    LeafEntry(const KeyT& key, IndexT data_index)
+        : key(key), data_index(data_index) {}
+
+    Rectangle bounds() const {
+        return boundsOf(key);
+    }
+};
+
+// A [begin, end) view over the live records of a node.
+template <typename T>
+struct EntryRange {
+    T* first;
+    T* last;
+
+    T* begin() const { return first; }
+    T* end() const { return last; }
+    size_t size() const { return static_cast<size_t>(last - first); }
+    T& operator[](size_t i) const { return first[i]; }
+};
+
+// Records are stored inline. A node is either internal (`entries`) or a leaf
+// (`leaf_entries`, keyed by Point in point trees), so the two arrays share
+// storage. One slot of slack lets a node overflow to MAX_ENTRIES + 1 before
+// it is split.
+template <typename KeyT = Rectangle, typename IndexT = uint32_t>
 struct Node {
+    static constexpr size_t CAPACITY = MAX_ENTRIES + 1;
+    static_assert(CAPACITY <= std::numeric_limits<uint16_t>::max(), "MAX_ENTRIES too large");
+
     bool is_leaf;
-    std::vector<Entry<DataT>> entries;
+    uint16_t count;
+    union {
+        BranchEntry<IndexT> entries[CAPACITY];
+        LeafEntry<KeyT, IndexT> leaf_entries[CAPACITY];
+    };
+
+    Node() : is_leaf(true), count(0) {}
+    Node(bool is_leaf) : is_leaf(is_leaf), count(0) {}
+
+    size_t size() const {
+        return count;
+    }
+
+    EntryRange<BranchEntry<IndexT>> branches() {
+        return {entries, entries + count};
+    }
+
+    EntryRange<const BranchEntry<IndexT>> branches() const {
+        return {entries, entries + count};
+    }
+
+    EntryRange<LeafEntry<KeyT, IndexT>> leaves() {
+        return {leaf_entries, leaf_entries + count};
+    }
+
+    EntryRange<const LeafEntry<KeyT, IndexT>> leaves() const {
+        return {leaf_entries, leaf_entries + count};
+    }
+
+    void push(const BranchEntry<IndexT>& entry) {
+        assert(!is_leaf && count < CAPACITY);
+        entries[count++] = entry;
+    }
+
+    void push(const LeafEntry<KeyT, IndexT>& entry) {
+        assert(is_leaf && count < CAPACITY);
+        leaf_entries[count++] = entry;
+    }
 
-    Node(bool is_leaf) : is_leaf(is_leaf) {}
+    // Removes record `i` by moving the last record into its slot.
+    void erase(size_t i) {
+        assert(i < count);
+        --count;
+        if (is_leaf) {
+            leaf_entries[i] = leaf_entries[count];
+        } else {
+            entries[i] = entries[count];
+        }
+    }
 };
 
-template <typename DataT>
-class RTree {
+// Chunked node storage. Nodes are allocated in fixed-size blocks that are
+// never reallocated, so adding a node neither copies existing ones nor
+// invalidates a Node& held by the caller. Released slots are reused by later
+// allocations; size() counts every slot handed out, released or not.
+template <typename NodeT, typename IndexT = uint32_t>
+class NodeArena {
 public:
-    std::vector<Node<DataT>> nodes;
-    size_t root_index;
+    static constexpr size_t CHUNK_SHIFT = 10;
+    static constexpr size_t CHUNK_SIZE = size_t(1) << CHUNK_SHIFT;
 
-    RTree() {
-        root_index = createNode(true);
+    NodeArena() = default;
+    NodeArena(NodeArena&&) = default;
+    NodeArena& operator=(NodeArena&&) = default;
+
+    NodeArena(const NodeArena& other) : node_count(0) {
+        *this = other;
     }
 
-    void insert(const Rectangle& rect, const DataT& data) {
-        size_t leaf_index = chooseLeaf(root_index, rect);
-        Node<DataT>& leaf = nodes[leaf_index];
-        leaf.entries.emplace_back(rect, data);
+    NodeArena& operator=(const NodeArena& other) {
+        if (this != &other) {
+            clear();
+            for (size_t i = 0; i < other.node_count; ++i) {
+                (*this)[allocate(true)] = other[static_cast<IndexT>(i)];
+            }
+            free_slots = other.free_slots;
+        }
+        return *this;
+    }
 
-        if (leaf.entries.size() > MAX_ENTRIES) {
-            splitNode(leaf_index);
+    IndexT allocate(bool is_leaf) {
+        if (!free_slots.empty()) {
+            IndexT index = free_slots.back();
+            free_slots.pop_back();
+            (*this)[index] = NodeT(is_leaf);
+            return index;
+        }
+        if (node_count >= INVALID_INDEX<IndexT>) {
+            throw std::length_error("Node index overflow");
+        }
+        if ((node_count & (CHUNK_SIZE - 1)) == 0) {
+            chunks.push_back(std::make_unique<NodeT[]>(CHUNK_SIZE));
         }
+        IndexT index = static_cast<IndexT>(node_count++);
+        (*this)[index] = NodeT(is_leaf);
+        return index;
     }
 
-    std::vector<DataT> rangeQuery(const Rectangle& rect) const {
-        std::vector<DataT> results;
-        rangeQueryHelper(root_index, rect, results);
-        return results;
+    NodeT& operator[](IndexT index) {
+        return chunks[index >> CHUNK_SHIFT][index & (CHUNK_SIZE - 1)];
     }
 
-private:
-    size_t createNode(bool is_leaf) {
-        nodes.emplace_back(is_leaf);
-        return nodes.size() - 1;
+    const NodeT& operator[](IndexT index) const {
+        return chunks[index >> CHUNK_SHIFT][index & (CHUNK_SIZE - 1)];
     }
 
-    size_t chooseLeaf(size_t node_index, const Rectangle& rect) {
-        Node<DataT>& node = nodes[node_index];
+    void release(IndexT index) {
+        free_slots.push_back(index);
+    }
 
-        if (node.is_leaf) {
-            return node_index;
+    size_t size() const {
+        return node_count;
+    }
+
+    size_t liveCount() const {
+        return node_count - free_slots.size();
+    }
+
+    void clear() {
+        chunks.clear();
+        free_slots.clear();
+        node_count = 0;
+    }
+
+    // Sizes the chunk table for `node_capacity` nodes, so allocating up to
+    // that many never moves it.
+    void reserve(size_t node_capacity) {
+        chunks.reserve((node_capacity + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    }
+
+private:
+    std::vector<std::unique_ptr<NodeT[]>> chunks;
+    std::vector<IndexT> free_slots;
+    size_t node_count = 0;
+};
+
+// Query-path instrumentation is compiled in only with -DRTREE_STATS. With it
+// off the counters stay zero and the query and insert paths carry no
+// bookkeeping at all.
+#ifdef RTREE_STATS
+constexpr bool STATS_ENABLED = true;
+#else
+constexpr bool STATS_ENABLED = false;
+#endif
+
+// Counters for one rangeQuery (or a sum over many).
+struct QueryStats {
+    std::vector<uint64_t> nodes_per_level;  // indexed by depth, root = 0
+    uint64_t entries_tested = 0;            // records compared against the query
+    uint64_t overlap_hits = 0;              // branch records the query descended into
+    uint64_t leaf_results = 0;              // leaf records returned
+    uint64_t false_descents = 0;            // descents whose subtree returned nothing
+
+    void recordVisit(size_t depth) {
+        if (nodes_per_level.size() <= depth) {
+            nodes_per_level.resize(depth + 1, 0);
         }
+        ++nodes_per_level[depth];
+    }
 
-        size_t best_index = 0;
-        float min_area_increase = std::numeric_limits<float>::max();
-        for (size_t i = 0; i < node.entries.size(); ++i) {
-            Rectangle& entry_rect = node.entries[i].bounding_box;
-            float area_before = entry_rect.area();
-            Rectangle expanded_rect = entry_rect;
-            expanded_rect.expand(rect);
-            float area_increase = expanded_rect.area() - area_before;
-            if (area_increase < min_area_increase) {
-                min_area_increase = area_increase;
-                best_index = i;
-            }
+    uint64_t nodesVisited() const {
+        uint64_t total = 0;
+        for (uint64_t count : nodes_per_level) {
+            total += count;
         }
+        return total;
+    }
 
-        node.entries[best_index].bounding_box.expand(rect);
-        size_t child_index = node.entries[best_index].child_index;
-        return chooseLeaf(child_index, rect);
+    void merge(const QueryStats& other) {
+        if (nodes_per_level.size() < other.nodes_per_level.size()) {
+            nodes_per_level.resize(other.nodes_per_level.size(), 0);
+        }
+        for (size_t i = 0; i < other.nodes_per_level.size(); ++i) {
+            nodes_per_level[i] += other.nodes_per_level[i];
+        }
+        entries_tested += other.entries_tested;
+        overlap_hits += other.overlap_hits;
+        leaf_results += other.leaf_results;
+        false_descents += other.false_descents;
     }
+};
 
+// Aggregate counters kept by each tree, see RTree::stats().
+struct TreeStats {
+    uint64_t queries = 0;
+    QueryStats query_totals;
+    uint64_t splits = 0;
+    uint64_t split_nanoseconds = 0;
+};
 
-    void splitNode(size_t node_index) {
-        Node<DataT>& node = nodes[node_index];
-        Node<DataT> new_node(node.is_leaf);
+// The counters behind RTree::stats(). Const queries on one tree can run at
+// the same time (under a shared lock, or from parallelFor workers), so each
+// counter is atomic and bumped with relaxed increments; snapshot() reads
+// them into a TreeStats. Depths past MAX_DEPTH are not counted per level.
+// Copying a tree copies the current values.
+struct TreeCounters {
+    static constexpr size_t MAX_DEPTH = 64;
 
-        size_t seed1 = 0, seed2 = 1;
-        float max_area_diff = -1.0f;
+    std::atomic<uint64_t> queries{0};
+    std::atomic<uint64_t> nodes_per_level[MAX_DEPTH] = {};
+    std::atomic<uint64_t> entries_tested{0};
+    std::atomic<uint64_t> overlap_hits{0};
+    std::atomic<uint64_t> leaf_results{0};
+    std::atomic<uint64_t> false_descents{0};
+    std::atomic<uint64_t> splits{0};
+    std::atomic<uint64_t> split_nanoseconds{0};
 
-        for (size_t i = 0; i < node.entries.size(); ++i) {
-            for (size_t j = i + 1; j < node.entries.size(); ++j) {
-                Rectangle combined = node.entries[i].bounding_box;
-                combined.expand(node.entries[j].bounding_box);
+    TreeCounters() = default;
 
-                float area_diff = combined.area() - node.entries[i].bounding_box.area() -
-                                node.entries[j].bounding_box.area();
+    TreeCounters(const TreeCounters& other) {
+        *this = other;
+    }
 
-                if (area_diff > max_area_diff) {
-                    max_area_diff = area_diff;
-                    seed1 = i;
-                    seed2 = j;
-                }
-            }
+    TreeCounters& operator=(const TreeCounters& other) {
+        auto copy = [](std::atomic<uint64_t>& to, const std::atomic<uint64_t>& from) {
+            to.store(from.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        };
+        copy(queries, other.queries);
+        for (size_t depth = 0; depth < MAX_DEPTH; ++depth) {
+            copy(nodes_per_level[depth], other.nodes_per_level[depth]);
         }
+        copy(entries_tested, other.entries_tested);
+        copy(overlap_hits, other.overlap_hits);
+        copy(leaf_results, other.leaf_results);
+        copy(false_descents, other.false_descents);
+        copy(splits, other.splits);
+        copy(split_nanoseconds, other.split_nanoseconds);
+        return *this;
+    }
 
-        Entry<DataT> seed1_entry = std::move(node.entries[seed1]);
-        Entry<DataT> seed2_entry = std::move(node.entries[seed2]);
+    void addQuery(const QueryStats& query_stats) {
+        queries.fetch_add(1, std::memory_order_relaxed);
+        for (size_t depth = 0; depth < std::min(query_stats.nodes_per_level.size(), MAX_DEPTH); ++depth) {
+            nodes_per_level[depth].fetch_add(query_stats.nodes_per_level[depth], std::memory_order_relaxed);
+        }
+        entries_tested.fetch_add(query_stats.entries_tested, std::memory_order_relaxed);
+        overlap_hits.fetch_add(query_stats.overlap_hits, std::memory_order_relaxed);
+        leaf_results.fetch_add(query_stats.leaf_results, std::memory_order_relaxed);
+        false_descents.fetch_add(query_stats.false_descents, std::memory_order_relaxed);
+    }
 
-        std::vector<Entry<DataT>> remaining_entries;
-        for (size_t i = 0; i < node.entries.size(); ++i) {
-            if (i != seed1 && i != seed2) {
-                remaining_entries.push_back(std::move(node.entries[i]));
+    TreeStats snapshot() const {
+        TreeStats stats;
+        stats.queries = queries.load(std::memory_order_relaxed);
+        for (size_t depth = 0; depth < MAX_DEPTH; ++depth) {
+            uint64_t visited = nodes_per_level[depth].load(std::memory_order_relaxed);
+            if (visited > 0) {
+                stats.query_totals.nodes_per_level.resize(depth + 1, 0);
+                stats.query_totals.nodes_per_level[depth] = visited;
             }
         }
+        stats.query_totals.entries_tested = entries_tested.load(std::memory_order_relaxed);
+        stats.query_totals.overlap_hits = overlap_hits.load(std::memory_order_relaxed);
+        stats.query_totals.leaf_results = leaf_results.load(std::memory_order_relaxed);
+        stats.query_totals.false_descents = false_descents.load(std::memory_order_relaxed);
+        stats.splits = splits.load(std::memory_order_relaxed);
+        stats.split_nanoseconds = split_nanoseconds.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
 
-        node.entries.clear();
-        node.entries.push_back(std::move(seed1_entry));
-        new_node.entries.push_back(std::move(seed2_entry));
+// Single-line key=value dump, for scraping.
+inline std::ostream& operator<<(std::ostream& out, const TreeStats& stats) {
+    out << "queries=" << stats.queries
+        << " nodes_visited=" << stats.query_totals.nodesVisited();
+    for (size_t depth = 0; depth < stats.query_totals.nodes_per_level.size(); ++depth) {
+        out << " nodes_visited_depth" << depth << "=" << stats.query_totals.nodes_per_level[depth];
+    }
+    return out << " entries_tested=" << stats.query_totals.entries_tested
+               << " overlap_hits=" << stats.query_totals.overlap_hits
+               << " leaf_results=" << stats.query_totals.leaf_results
+               << " false_descents=" << stats.query_totals.false_descents
+               << " splits=" << stats.splits
+               << " split_ns=" << stats.split_nanoseconds;
+}
 
-        for (auto& entry : remaining_entries) {
-            Rectangle rect1 = node.entries[0].bounding_box;
-            Rectangle rect2 = new_node.entries[0].bounding_box;
-            Rectangle expanded1 = rect1;
-            Rectangle expanded2 = rect2;
-            expanded1.expand(entry.bounding_box);
-            expanded2.expand(entry.bounding_box);
-            float area_increase1 = expanded1.area() - rect1.area();
-            float area_increase2 = expanded2.area() - rect2.area();
-            if (area_increase1 < area_increase2) {
-                node.entries.push_back(std::move(entry));
-            } else {
-                new_node.entries.push_back(std::move(entry));
+// Position of cell (x, y) along a Hilbert curve over a 2^16 x 2^16 grid.
+inline uint64_t hilbertIndex(uint32_t x, uint32_t y) {
+    constexpr uint32_t GRID = 1u << 16;
+    uint64_t index = 0;
+    for (uint32_t s = GRID / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) ? 1 : 0;
+        uint32_t ry = (y & s) ? 1 : 0;
+        index += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = GRID - 1 - x;
+                y = GRID - 1 - y;
             }
+            std::swap(x, y);
         }
+    }
+    return index;
+}
 
-        if (node_index == root_index) {
-            root_index = createNode(false);
-            Node<DataT>& root = nodes[root_index];
-            size_t new_node_index = nodes.size();
-            nodes.push_back(std::move(new_node));
-            Rectangle mbr1 = node.entries[0].bounding_box;
-            for (size_t i = 1; i < node.entries.size(); ++i) {
-                mbr1.expand(node.entries[i].bounding_box);
-            }
+// Hilbert index of the centre of `box` on a grid spanning `bounds`.
+inline uint64_t hilbertKey(const Rectangle& box, const Rectangle& bounds) {
+    auto cell = [](float v, float lo, float hi) {
+        float t = hi > lo ? (v - lo) / (hi - lo) : 0.0f;
+        return static_cast<uint32_t>(std::min(std::max(t, 0.0f), 1.0f) * 65535.0f);
+    };
+    return hilbertIndex(cell((box.x_min + box.x_max) * 0.5f, bounds.x_min, bounds.x_max),
+                        cell((box.y_min + box.y_max) * 0.5f, bounds.y_min, bounds.y_max));
+}
 
-            Rectangle mbr2 = nodes[new_node_index].entries[0].bounding_box;
-            for (size_t i = 1; i < nodes[new_node_index].entries.size(); ++i) {
-                mbr2.expand(nodes[new_node_index].entries[i].bounding_box);
-            }
-            root.entries.emplace_back(mbr1);
-            root.entries.back().child_index = node_index;
+// Splits a fixed `domain` rectangle into contiguous ranges of Hilbert keys,
+// one per partition; a box belongs to the range holding the key of its
+// centre. The ranges start equal, and recut() moves the boundaries to
+// quantiles of a sorted set of keys.
+class HilbertPartitioner {
+public:
+    HilbertPartitioner(size_t partitions, const Rectangle& domain) : domain(domain) {
+        partitions = std::max<size_t>(partitions, 1);
+        for (size_t i = 0; i < partitions; ++i) {
+            starts.push_back(KEY_SPACE / partitions * i);
+        }
+    }
 
-            root.entries.emplace_back(mbr2);
-            root.entries.back().child_index = new_node_index;
-        } else {
-            size_t parent_index = findParent(node_index);
-            Node<DataT>& parent = nodes[parent_index];
-            for (auto& entry : parent.entries) {
-                if (entry.child_index == node_index) {
-                    Rectangle mbr = node.entries[0].bounding_box;
-                    for (size_t i = 1; i < node.entries.size(); ++i) {
-                        mbr.expand(node.entries[i].bounding_box);
-                    }
-                    entry.bounding_box = mbr;
-                    break;
-                }
-            }
+    uint64_t keyOf(const Rectangle& box) const {
+        return hilbertKey(box, domain);
+    }
+
+    size_t partitionOf(const Rectangle& box) const {
+        return partitionOfKey(keyOf(box));
+    }
+
+    size_t partitionOfKey(uint64_t key) const {
+        return static_cast<size_t>(std::upper_bound(starts.begin(), starts.end(), key) - starts.begin()) - 1;
+    }
+
+    size_t partitions() const {
+        return starts.size();
+    }
+
+    // Equal keys must share a partition, so a cut that would split a run
+    // of them moves to the run's start. An empty set leaves the ranges.
+    void recut(const std::vector<uint64_t>& sorted_keys) {
+        if (sorted_keys.empty()) {
+            return;
+        }
+        for (size_t i = 1; i < starts.size(); ++i) {
+            starts[i] = std::max(sorted_keys[sorted_keys.size() * i / starts.size()], starts[i - 1]);
+        }
+    }
 
-            size_t new_node_index = nodes.size();
-            nodes.push_back(std::move(new_node));
-            Rectangle mbr_new_node = nodes[new_node_index].entries[0].bounding_box;
-            for (size_t i = 1; i < nodes[new_node_index].entries.size(); ++i) {
-                mbr_new_node.expand(nodes[new_node_index].entries[i].bounding_box);
+private:
+    // hilbertIndex() maps a 2^16 x 2^16 grid onto keys below 2^32.
+    static constexpr uint64_t KEY_SPACE = uint64_t(1) << 32;
+
+    Rectangle domain;
+    std::vector<uint64_t> starts;  // first key of each partition's range
+};
+
+// Shape of one tree level, as reported by RTree::analyze().
+struct LevelReport {
+    size_t nodes = 0;
+    size_t entries = 0;
+    size_t underfull = 0;                // non-root nodes below MIN_ENTRIES
+    std::vector<size_t> fill_histogram;  // node count by number of records
+    double total_area = 0;               // sum of node MBR areas
+    double total_margin = 0;             // sum of node MBR perimeters
+    double sibling_overlap = 0;          // pairwise overlap of nodes sharing a parent
+    double dead_space = 0;               // node area not covered by any of its records
+};
+
+// Tree health summary. Levels are indexed by depth, root first.
+struct TreeReport {
+    size_t height = 0;
+    size_t entries = 0;
+    size_t nodes = 0;
+    std::vector<LevelReport> levels;
+
+    // Average records per node as a fraction of MAX_ENTRIES.
+    double averageFill() const {
+        size_t records = 0;
+        for (const auto& level : levels) {
+            records += level.entries;
+        }
+        return nodes == 0 ? 0.0 : static_cast<double>(records) / static_cast<double>(nodes * MAX_ENTRIES);
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& out, const TreeReport& report) {
+    out << "height " << report.height << ", entries " << report.entries << ", nodes " << report.nodes
+        << ", average fill " << report.averageFill() * 100.0 << "% (min " << MIN_ENTRIES
+        << ", max " << MAX_ENTRIES << ")\n";
+    for (size_t depth = 0; depth < report.levels.size(); ++depth) {
+        const LevelReport& level = report.levels[depth];
+        out << "depth " << depth << (depth + 1 == report.levels.size() ? " (leaves)" : "")
+            << ": nodes " << level.nodes << ", underfull " << level.underfull << ", fill";
+        for (size_t count = 0; count < level.fill_histogram.size(); ++count) {
+            out << " " << count << ":" << level.fill_histogram[count];
+        }
+        out << ", area " << level.total_area << ", margin " << level.total_margin
+            << ", sibling overlap " << level.sibling_overlap << ", dead space " << level.dead_space << "\n";
+    }
+    return out;
+}
+
+// Area covered by the union of a node's boxes. Sweeps the vertical slabs
+// between consecutive x edges and merges the y intervals of the boxes
+// spanning each one: O(n^2 log n) for n boxes.
+inline double unionArea(const std::vector<Rectangle>& boxes) {
+    std::vector<float> edges;
+    for (const auto& box : boxes) {
+        edges.push_back(box.x_min);
+        edges.push_back(box.x_max);
+    }
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    double total = 0;
+    std::vector<std::pair<float, float>> spans;
+    for (size_t slab = 0; slab + 1 < edges.size(); ++slab) {
+        spans.clear();
+        for (const auto& box : boxes) {
+            if (box.x_min <= edges[slab] && box.x_max >= edges[slab + 1] && box.y_min < box.y_max) {
+                spans.emplace_back(box.y_min, box.y_max);
             }
-            parent.entries.emplace_back(mbr_new_node);
-            parent.entries.back().child_index = new_node_index;
-            if (parent.entries.size() > MAX_ENTRIES) {
-                splitNode(parent_index);
+        }
+        std::sort(spans.begin(), spans.end());
+        double covered = 0;
+        float run_start = 0, run_end = -std::numeric_limits<float>::max();
+        for (const auto& span : spans) {
+            if (span.first > run_end) {
+                covered += std::max(0.0, static_cast<double>(run_end) - run_start);
+                run_start = span.first;
             }
+            run_end = std::max(run_end, span.second);
         }
+        covered += std::max(0.0, static_cast<double>(run_end) - run_start);
+        total += covered * (static_cast<double>(edges[slab + 1]) - edges[slab]);
     }
+    return total;
+}
 
+// Exact shape for the refinement step of RTree::refinedQuery(): a simple
+// polygon (closed ring, no holes) or a polyline. Vertices are kept as
+// separate x and y arrays so the edge loops in the predicates below run
+// branch-free over contiguous floats and vectorize (at -O3).
+class Geometry {
+public:
+    enum class Kind { Polygon, Polyline };
 
-    size_t findParent(size_t child_index) {
-        for (size_t i = 0; i < nodes.size(); ++i) {
-            Node<DataT>& node = nodes[i];
-            if (!node.is_leaf) {
-                for (const auto& entry : node.entries) {
-                    if (entry.child_index == child_index) {
-                        return i;
-                    }
-                }
-            }
+    Kind kind = Kind::Polyline;
+    std::vector<float> xs, ys;
+
+    Geometry() = default;
+    Geometry(Kind kind, const std::vector<Point>& vertices) : kind(kind) {
+        if (vertices.size() < (kind == Kind::Polygon ? 3u : 2u)) {
+            throw std::invalid_argument("Geometry needs 3 vertices for a polygon, 2 for a polyline");
+        }
+        box = Rectangle(vertices[0].x, vertices[0].y, vertices[0].x, vertices[0].y);
+        for (const auto& vertex : vertices) {
+            xs.push_back(vertex.x);
+            ys.push_back(vertex.y);
+            box.expand(Rectangle(vertex.x, vertex.y, vertex.x, vertex.y));
         }
-        throw std::runtime_error("Parent node not found");
     }
 
+    static Geometry polygon(const std::vector<Point>& ring) {
+        return Geometry(Kind::Polygon, ring);
+    }
 
-    void distributeEntries(std::vector<Entry<DataT>>& group1,
-                           std::vector<Entry<DataT>>& group2,
-                           Entry<DataT>& seed1, Entry<DataT>& seed2) {
-        group1.push_back(std::move(seed1));
-        group2.push_back(std::move(seed2));
+    static Geometry polyline(const std::vector<Point>& vertices) {
+        return Geometry(Kind::Polyline, vertices);
     }
 
-    void rangeQueryHelper(size_t node_index, const Rectangle& rect, std::vector<DataT>& results) const {
-        const Node<DataT>& node = nodes[node_index];
+    Rectangle bounds() const {
+        return box;
+    }
 
-        for (const auto& entry : node.entries) {
-            if (entry.bounding_box.overlaps(rect)) {
-                if (node.is_leaf) {
-                    results.push_back(*entry.data);
-                } else {
-                    rangeQueryHelper(entry.child_index, rect, results);
-                }
+    // Point-in-polygon by crossing number; always false for a polyline.
+    // Points exactly on the boundary may land either way.
+    bool containsPoint(float x, float y) const {
+        if (kind != Kind::Polygon) {
+            return false;
+        }
+        size_t n = xs.size();
+        unsigned crossings = crosses(x, y, xs[0], ys[0], xs[n - 1], ys[n - 1]);
+        for (size_t i = 1; i < n; ++i) {
+            crossings += crosses(x, y, xs[i], ys[i], xs[i - 1], ys[i - 1]);
+        }
+        return crossings & 1;
+    }
+
+private:
+    // Whether a ray from (x, y) towards +x crosses edge (xi, yi)-(xj, yj).
+    // The crossing's x is compared by cross-multiplying rather than
+    // dividing, so the test has no branches.
+    static unsigned crosses(float x, float y, float xi, float yi, float xj, float yj) {
+        unsigned straddles = (yi > y) ^ (yj > y);
+        float dy = yj - yi;
+        float side = (x - xi) * dy - (y - yi) * (xj - xi);
+        return straddles & (side * dy < 0);
+    }
+
+    Rectangle box;
+};
+
+// Whether segment (x1, y1)-(x2, y2) meets any segment (qx[k], qy[k]) -
+// (qx[k + 1], qy[k + 1]) for k < count. Closed, so touching counts, unless
+// `proper`, which counts only crossings through both interiors.
+inline bool segmentHitsChain(float x1, float y1, float x2, float y2,
+                             const float* qx, const float* qy, size_t count, bool proper) {
+    // Flags are ints combined with bitwise ops, which keeps the loop free of
+    // branches so it vectorizes.
+    int closed = !proper;
+    int hit = 0;
+    float px_min = std::min(x1, x2), px_max = std::max(x1, x2);
+    float py_min = std::min(y1, y2), py_max = std::max(y1, y2);
+    for (size_t k = 0; k < count; ++k) {
+        float ax = qx[k], ay = qy[k], bx = qx[k + 1], by = qy[k + 1];
+        float o1 = (x2 - x1) * (ay - y1) - (y2 - y1) * (ax - x1);
+        float o2 = (x2 - x1) * (by - y1) - (y2 - y1) * (bx - x1);
+        float o3 = (bx - ax) * (y1 - ay) - (by - ay) * (x1 - ax);
+        float o4 = (bx - ax) * (y2 - ay) - (by - ay) * (x2 - ax);
+        int interiors_cross = (o1 * o2 < 0) & (o3 * o4 < 0);
+        int touches = (o1 * o2 <= 0) & (o3 * o4 <= 0);
+        // Collinear segments pass the orientation test even when they are
+        // disjoint, so those also need their extents to overlap.
+        int collinear = (o1 == 0) & (o2 == 0);
+        int extents_meet = (px_max >= std::min(ax, bx)) & (std::max(ax, bx) >= px_min) &
+                           (py_max >= std::min(ay, by)) & (std::max(ay, by) >= py_min);
+        hit |= interiors_cross | (closed & touches & ((collinear ^ 1) | extents_meet));
+    }
+    return hit;
+}
+
+// Whether any edge of `a` meets any edge of `b` (see segmentHitsChain).
+inline bool edgesMeet(const Geometry& a, const Geometry& b, bool proper) {
+    auto edges = [](const Geometry& g, auto f) {
+        size_t n = g.xs.size();
+        for (size_t i = 0; i + 1 < n; ++i) {
+            if (f(g.xs[i], g.ys[i], g.xs[i + 1], g.ys[i + 1])) {
+                return true;
             }
         }
+        return g.kind == Geometry::Kind::Polygon && f(g.xs[n - 1], g.ys[n - 1], g.xs[0], g.ys[0]);
+    };
+    size_t n = b.xs.size();
+    float closing_x[2] = {b.xs[n - 1], b.xs[0]};
+    float closing_y[2] = {b.ys[n - 1], b.ys[0]};
+    return edges(a, [&](float x1, float y1, float x2, float y2) {
+        return segmentHitsChain(x1, y1, x2, y2, b.xs.data(), b.ys.data(), n - 1, proper) ||
+               (b.kind == Geometry::Kind::Polygon &&
+                segmentHitsChain(x1, y1, x2, y2, closing_x, closing_y, 1, proper));
+    });
+}
+
+// Shapes share at least one point (boundaries included).
+inline bool intersects(const Geometry& a, const Geometry& b) {
+    if (!a.bounds().intersects(b.bounds())) {
+        return false;
+    }
+    return edgesMeet(a, b, false) || a.containsPoint(b.xs[0], b.ys[0]) || b.containsPoint(a.xs[0], a.ys[0]);
+}
+
+// Polygon `a` contains `b`: every vertex of `b` is inside `a` and no edge of
+// `b` crosses out through an edge of `a`.
+inline bool contains(const Geometry& a, const Geometry& b) {
+    if (a.kind != Geometry::Kind::Polygon || !a.bounds().contains(b.bounds())) {
+        return false;
+    }
+    for (size_t i = 0; i < b.xs.size(); ++i) {
+        if (!a.containsPoint(b.xs[i], b.ys[i])) {
+            return false;
+        }
+    }
+    return !edgesMeet(a, b, true);
+}
+
+inline bool within(const Geometry& a, const Geometry& b) {
+    return contains(b, a);
+}
+
+// How a candidate's shape must relate to the query shape.
+enum class GeometryPredicate { Intersects, Contains, Within };
+
+inline bool evaluate(GeometryPredicate predicate, const Geometry& candidate, const Geometry& query) {
+    switch (predicate) {
+        case GeometryPredicate::Intersects:
+            return intersects(candidate, query);
+        case GeometryPredicate::Contains:
+            return contains(candidate, query);
+        case GeometryPredicate::Within:
+            return within(candidate, query);
+    }
+    return false;
+}
+
+// Filter and refinement counts of refinedQuery() calls. The false-positive
+// rate is the share of MBR candidates that the exact test rejected.
+struct RefineStats {
+    uint64_t candidates = 0;
+    uint64_t results = 0;
+
+    double falsePositiveRate() const {
+        return candidates ? static_cast<double>(candidates - results) / static_cast<double>(candidates) : 0.0;
     }
 };
-void runTests() {
-    RTree<int> rtree;
 
-    // Test 1: Basic insertion
-    Rectangle rect1(0, 0, 5, 5);
-    rtree.insert(rect1, 1);
-    auto results = rtree.rangeQuery(Rectangle(0, 0, 10, 10));
-    assert(results.size() == 1 && results[0] == 1);
-    std::cout << "Test 1 passed!" << std::endl;
+// Half-line origin + t * direction for 0 <= t <= t_max. A segment from `a`
+// to `b` is the ray from `a` along b - a with t_max = 1, so t is the share
+// of the segment travelled.
+struct Ray {
+    Point origin;
+    Point direction;
+    float t_max = std::numeric_limits<float>::infinity();
 
-    // Test 2: Overlapping rectangles
-    Rectangle rect2(6, 6, 10, 10);
-    rtree.insert(rect2, 2);
-    results = rtree.rangeQuery(Rectangle(0, 0, 10, 10));
-    assert(results.size() == 2);
-    std::cout << "Test 2 passed!" << std::endl;
+    Ray() = default;
+    Ray(const Point& origin, const Point& direction, float t_max = std::numeric_limits<float>::infinity())
+        : origin(origin), direction(direction), t_max(t_max) {}
 
-    // Test 3: Non-overlapping query
-    results = rtree.rangeQuery(Rectangle(15, 15, 20, 20));
-    assert(results.empty());
-    std::cout << "Test 3 passed!" << std::endl;
+    static Ray segment(const Point& from, const Point& to) {
+        return Ray(from, Point(to.x - from.x, to.y - from.y), 1.0f);
+    }
 
-    // Test 4: Splitting nodes
-    Rectangle rect3(11, 11, 15, 15);
-    Rectangle rect4(16, 16, 20, 20);
-    rtree.insert(rect3, 3);
-    rtree.insert(rect4, 4);
-    results = rtree.rangeQuery(Rectangle(10, 10, 20, 20));    
-    assert(results.size() == 2 && std::find(results.begin(), results.end(), 3) != results.end());
-    std::cout << "Test 4 passed!" << std::endl;
-    std::cout << "All tests passed!" << std::endl;
+    Point at(float t) const {
+        return Point(origin.x + t * direction.x, origin.y + t * direction.y);
+    }
+};
+
+// Slab test of `ray` against `count` boxes given as coordinate arrays:
+// t_enter[i] is the parameter at which the ray enters box i (0 if it starts
+// inside), or infinity if it misses the box within [0, t_max]. Boxes are
+// closed, so grazing an edge or corner counts. The loop is branch-free and
+// vectorizes; on an axis the ray runs parallel to, the division yields an
+// infinite inverse and the slab becomes a plain interval test on the origin.
+inline void slabTest(const Ray& ray, const float* x_min, const float* y_min, const float* x_max,
+                     const float* y_max, size_t count, float* t_enter) {
+    constexpr float INF = std::numeric_limits<float>::infinity();
+    const float ox = ray.origin.x, oy = ray.origin.y, t_max = ray.t_max;
+    const float inv_x = 1.0f / ray.direction.x, inv_y = 1.0f / ray.direction.y;
+    const bool flat_x = ray.direction.x == 0.0f, flat_y = ray.direction.y == 0.0f;
+    for (size_t i = 0; i < count; ++i) {
+        float ax = (x_min[i] - ox) * inv_x, bx = (x_max[i] - ox) * inv_x;
+        float ay = (y_min[i] - oy) * inv_y, by = (y_max[i] - oy) * inv_y;
+        float lo_x = std::min(ax, bx), hi_x = std::max(ax, bx);
+        float lo_y = std::min(ay, by), hi_y = std::max(ay, by);
+        float outside_x = (ox < x_min[i]) | (ox > x_max[i]) ? INF : -INF;
+        float outside_y = (oy < y_min[i]) | (oy > y_max[i]) ? INF : -INF;
+        lo_x = flat_x ? outside_x : lo_x;
+        hi_x = flat_x ? -outside_x : hi_x;
+        lo_y = flat_y ? outside_y : lo_y;
+        hi_y = flat_y ? -outside_y : hi_y;
+        float lo = std::max(std::max(lo_x, lo_y), 0.0f);
+        float hi = std::min(std::min(hi_x, hi_y), t_max);
+        t_enter[i] = lo <= hi ? lo : INF;
+    }
 }
 
-int main() {
+// slabTest() for a single box.
+inline float slabEntry(const Ray& ray, const Rectangle& box) {
+    float t_enter;
+    slabTest(ray, &box.x_min, &box.y_min, &box.x_max, &box.y_max, 1, &t_enter);
+    return t_enter;
+}
+
+// Runs fn(i) for every i < count on `threads` workers (0 = one per core).
+// Indices are handed out from a shared counter, so uneven items balance.
+template <typename Fn>
+void parallelFor(size_t count, size_t threads, Fn fn) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, count);
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            fn(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; ++t) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Entry orders RTree::bulkLoad() can pack in.
+enum class PackingOrder {
+    SortTileRecursive,
+    Hilbert
+};
+
+// Physical node orders RTree::relayout() can produce.
+enum class NodeLayout {
+    BreadthFirst,
+    VanEmdeBoas
+};
+
+template <typename DataT, typename KeyT = Rectangle, typename IndexT = uint32_t>
+class RTree {
+public:
+    static_assert(std::is_unsigned<IndexT>::value, "IndexT must be an unsigned integer type");
+
+    using NodeType = Node<KeyT, IndexT>;
+
+    NodeArena<NodeType, IndexT> nodes;
+    std::vector<DataT> payloads;
+    IndexT root_index;
+
+    RTree() {
+        root_index = createNode(true);
+    }
+
+    void insert(const KeyT& key, const DataT& data) {
+        LeafEntry<KeyT, IndexT> entry(key, storePayload(data));
+        ++entry_count;
+        if (ingest_capacity > 0) {
+            ingest_buffer.push_back(entry);
+            if (ingest_buffer.size() >= ingest_capacity) {
+                flushIngest();
+            }
+            return;
+        }
+        insertEntry(entry);
+    }
+
+    // Inserts a whole batch at once. The batch is routed down the tree in
+    // groups, so entries bound for the same subtree share one descent, and a
+    // node that overflows is split once into as many nodes as it needs
+    // (Hilbert-ordered when there are more than two) instead of once per
+    // entry.
+    void insertBatch(const std::vector<std::pair<KeyT, DataT>>& batch) {
+        std::vector<LeafEntry<KeyT, IndexT>> records;
+        records.reserve(batch.size());
+        for (const auto& item : batch) {
+            records.emplace_back(item.first, storePayload(item.second));
+        }
+        entry_count += batch.size();
+        insertLeafRecords(records);
+    }
+
+    // Buffered ingest. Until endIngest(), insert() only appends to an
+    // unindexed L0 buffer. Every `capacity` inserts the buffer is flushed
+    // through the insertBatch path, so records share descents and splits.
+    // When the buffer is at least as large as the indexed part, it is
+    // bulk-merged instead. Queries and remove() also scan the buffer, so
+    // results never lag behind inserts; in exchange a larger capacity makes
+    // each query pay for a longer linear scan.
+    void beginIngest(size_t capacity = 16384) {
+        ingest_capacity = std::max<size_t>(capacity, 1);
+    }
+
+    void endIngest() {
+        flushIngest();
+        ingest_capacity = 0;
+    }
+
+    void flushIngest() {
+        if (ingest_buffer.empty()) {
+            return;
+        }
+        size_t indexed = entry_count - ingest_buffer.size();
+        if (ingest_buffer.size() >= indexed) {
+            std::vector<LeafEntry<KeyT, IndexT>> leaf_records = std::move(ingest_buffer);
+            gatherLeafRecords(root_index, leaf_records);
+            nodes.clear();
+            packLeafRecords(leaf_records);
+        } else {
+            insertLeafRecords(ingest_buffer);
+        }
+        ingest_buffer.clear();
+    }
+
+    // Bottom-up packing, Sort-Tile-Recursive unless `order` says Hilbert.
+    // Replaces the current contents with a tree whose nodes are full, which
+    // answers queries far better than one built by repeated insert().
+    void bulkLoad(const std::vector<std::pair<KeyT, DataT>>& items,
+                  PackingOrder order = PackingOrder::SortTileRecursive) {
+        nodes.clear();
+        payloads.clear();
+        free_payloads.clear();
+        ingest_buffer.clear();
+        payloads.reserve(items.size());
+        entry_count = items.size();
+
+        std::vector<LeafEntry<KeyT, IndexT>> leaf_records;
+        leaf_records.reserve(items.size());
+        for (const auto& item : items) {
+            leaf_records.emplace_back(item.first, storePayload(item.second));
+        }
+        packLeafRecords(leaf_records, order);
+    }
+
+    // Removes one entry whose key and payload both match. Returns false if
+    // there is none. Underfull nodes are dissolved and their entries
+    // reinserted, as in Guttman's CondenseTree.
+    bool remove(const KeyT& key, const DataT& data) {
+        for (size_t i = 0; i < ingest_buffer.size(); ++i) {
+            if (ingest_buffer[i].key == key && payloads[ingest_buffer[i].data_index] == data) {
+                free_payloads.push_back(ingest_buffer[i].data_index);
+                ingest_buffer[i] = ingest_buffer.back();
+                ingest_buffer.pop_back();
+                --entry_count;
+                return true;
+            }
+        }
+
+        std::vector<IndexT> path;
+        size_t slot = 0;
+        IndexT leaf_index = findLeaf(root_index, key, data, path, slot);
+        if (leaf_index == INVALID_INDEX<IndexT>) {
+            return false;
+        }
+
+        NodeType& leaf = nodes[leaf_index];
+        free_payloads.push_back(leaf.leaf_entries[slot].data_index);
+        leaf.erase(slot);
+        --entry_count;
+        condenseTree(leaf_index, path);
+        return true;
+    }
+
+    std::vector<DataT> rangeQuery(const Rectangle& rect) const {
+        QueryStats query_stats;
+        return rangeQuery(rect, query_stats);
+    }
+
+    // As above, also adding this query's counters to `query_stats` when
+    // built with RTREE_STATS.
+    std::vector<DataT> rangeQuery(const Rectangle& rect, QueryStats& query_stats) const {
+        std::vector<DataT> results;
+        rangeQueryHelper(root_index, rect, results, query_stats, 0);
+        for (const auto& entry : ingest_buffer) {
+            if (keyMatches(entry.key, rect)) {
+                results.push_back(payloads[entry.data_index]);
+            }
+        }
+        if constexpr (STATS_ENABLED) {
+            tree_stats.addQuery(query_stats);
+        }
+        return results;
+    }
+
+    // Lazy rangeQuery(): the cursor keeps the traversal stack and produces
+    // hits on demand, in the order rangeQuery() would return them, so a
+    // caller can take one page, stop, and resume later without the full
+    // result set ever being buffered. Like DistanceBrowser it reads the tree
+    // in place and must not be used across modifications.
+    class RangeCursor {
+    public:
+        RangeCursor(const RTree& tree, const Rectangle& rect) : tree(&tree), rect(rect) {
+            stack.push_back({tree.root_index, 0});
+        }
+
+        // The next hit; false once the query is exhausted.
+        bool next(DataT& data) {
+            while (!stack.empty()) {
+                Frame& frame = stack.back();
+                const NodeType& node = tree->nodes[frame.node_index];
+                if (frame.position == node.size()) {
+                    stack.pop_back();
+                    continue;
+                }
+                size_t i = frame.position++;
+                if (node.is_leaf) {
+                    if (keyMatches(node.leaf_entries[i].key, rect)) {
+                        data = tree->payloads[node.leaf_entries[i].data_index];
+                        return true;
+                    }
+                } else if (node.entries[i].bounding_box.intersects(rect)) {
+                    stack.push_back({node.entries[i].child_index, 0});
+                }
+            }
+            while (buffer_position < tree->ingest_buffer.size()) {
+                const auto& entry = tree->ingest_buffer[buffer_position++];
+                if (keyMatches(entry.key, rect)) {
+                    data = tree->payloads[entry.data_index];
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Appends up to `limit` further hits to `out` and returns how many;
+        // fewer than `limit` means the query is exhausted.
+        size_t fetch(std::vector<DataT>& out, size_t limit) {
+            size_t fetched = 0;
+            DataT data;
+            while (fetched < limit && next(data)) {
+                out.push_back(data);
+                ++fetched;
+            }
+            return fetched;
+        }
+
+    private:
+        struct Frame {
+            IndexT node_index;
+            size_t position;  // next record of the node to test
+        };
+
+        const RTree* tree;
+        Rectangle rect;
+        std::vector<Frame> stack;
+        size_t buffer_position = 0;
+    };
+
+    RangeCursor rangeCursor(const Rectangle& rect) const {
+        return RangeCursor(*this, rect);
+    }
+
+    // Predicate variants of rangeQuery. Each one descends only into
+    // children that can still hold a match, so it opens fewer nodes than an
+    // overlap query filtered afterwards:
+    //   withinQuery   - keys inside `rect`; a node wholly inside `rect` is
+    //                   reported without testing its keys
+    //   containsQuery - keys whose box contains `rect`
+    //   stabQuery     - keys whose box contains `point`
+    //   exactQuery    - keys whose box equals `rect`
+    // All tests are closed: boxes touching the boundary count as inside.
+    std::vector<DataT> withinQuery(const Rectangle& rect) const {
+        QueryStats query_stats;
+        return withinQuery(rect, query_stats);
+    }
+
+    std::vector<DataT> withinQuery(const Rectangle& rect, QueryStats& query_stats) const {
+        return predicateQuery([&](const Rectangle& box) { return box.intersects(rect); },
+                              [&](const Rectangle& box) { return rect.contains(box); }, true, query_stats);
+    }
+
+    std::vector<DataT> containsQuery(const Rectangle& rect) const {
+        QueryStats query_stats;
+        return containsQuery(rect, query_stats);
+    }
+
+    std::vector<DataT> containsQuery(const Rectangle& rect, QueryStats& query_stats) const {
+        auto covers = [&](const Rectangle& box) { return box.contains(rect); };
+        return predicateQuery(covers, covers, false, query_stats);
+    }
+
+    std::vector<DataT> stabQuery(const Point& point) const {
+        QueryStats query_stats;
+        return stabQuery(point, query_stats);
+    }
+
+    std::vector<DataT> stabQuery(const Point& point, QueryStats& query_stats) const {
+        auto covers = [&](const Rectangle& box) { return box.contains(point); };
+        return predicateQuery(covers, covers, false, query_stats);
+    }
+
+    std::vector<DataT> exactQuery(const Rectangle& rect) const {
+        QueryStats query_stats;
+        return exactQuery(rect, query_stats);
+    }
+
+    std::vector<DataT> exactQuery(const Rectangle& rect, QueryStats& query_stats) const {
+        return predicateQuery([&](const Rectangle& box) { return box.contains(rect); },
+                              [&](const Rectangle& box) { return box == rect; }, false, query_stats);
+    }
+
+    // Best-first search queue record shared by rayQuery() and
+    // DistanceBrowser: a node or leaf entry keyed by the order it must come
+    // out in (ray parameter or squared distance).
+    struct QueueItem {
+        float key;
+        bool is_entry;
+        uint32_t depth;
+        IndexT index;  // payload index for entries, node index otherwise
+
+        // Later in the queue: entries precede nodes with the same key.
+        bool operator>(const QueueItem& other) const {
+            if (key != other.key) {
+                return key > other.key;
+            }
+            if (is_entry != other.is_entry) {
+                return other.is_entry;
+            }
+            return index > other.index;
+        }
+    };
+    using BestFirstQueue = std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>>;
+
+    // Entries whose boxes `ray` meets, ordered by the parameter at which the
+    // ray enters them, stopping after `max_hits`; max_hits = 1 is a first-hit
+    // query. Best-first search: nodes and entries share one queue keyed by
+    // entry parameter, so an entry is reported only once no unopened node
+    // could be entered before it. Use Ray::segment() for line of sight.
+    std::vector<DataT> rayQuery(const Ray& ray, size_t max_hits = std::numeric_limits<size_t>::max()) const {
+        QueryStats query_stats;
+        return rayQuery(ray, max_hits, query_stats);
+    }
+
+    std::vector<DataT> rayQuery(const Ray& ray, size_t max_hits, QueryStats& query_stats) const {
+        constexpr float INF = std::numeric_limits<float>::infinity();
+        BestFirstQueue queue;
+
+        for (const auto& entry : ingest_buffer) {
+            float t = slabEntry(ray, entry.bounds());
+            if (t < INF) {
+                queue.push({t, true, 0, entry.data_index});
+            }
+        }
+        queue.push({0.0f, false, 0, root_index});
+
+        std::vector<DataT> results;
+        float x_min[NodeType::CAPACITY], y_min[NodeType::CAPACITY];
+        float x_max[NodeType::CAPACITY], y_max[NodeType::CAPACITY];
+        float t_enter[NodeType::CAPACITY];
+        while (!queue.empty() && results.size() < max_hits) {
+            QueueItem top = queue.top();
+            queue.pop();
+            if (top.is_entry) {
+                results.push_back(payloads[top.index]);
+                if constexpr (STATS_ENABLED) {
+                    ++query_stats.leaf_results;
+                }
+                continue;
+            }
+
+            const NodeType& node = nodes[top.index];
+            size_t count = node.size();
+            for (size_t i = 0; i < count; ++i) {
+                Rectangle box = node.is_leaf ? node.leaf_entries[i].bounds() : node.entries[i].bounding_box;
+                x_min[i] = box.x_min;
+                y_min[i] = box.y_min;
+                x_max[i] = box.x_max;
+                y_max[i] = box.y_max;
+            }
+            slabTest(ray, x_min, y_min, x_max, y_max, count, t_enter);
+            if constexpr (STATS_ENABLED) {
+                query_stats.recordVisit(top.depth);
+                query_stats.entries_tested += count;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (t_enter[i] == INF) {
+                    continue;
+                }
+                if (node.is_leaf) {
+                    queue.push({t_enter[i], true, top.depth, node.leaf_entries[i].data_index});
+                } else {
+                    queue.push({t_enter[i], false, top.depth + 1, node.entries[i].child_index});
+                    if constexpr (STATS_ENABLED) {
+                        ++query_stats.overlap_hits;
+                    }
+                }
+            }
+        }
+        if constexpr (STATS_ENABLED) {
+            tree_stats.addQuery(query_stats);
+        }
+        return results;
+    }
+
+    // Two-phase query. The filter step collects every entry whose box meets
+    // `rect` (closed, so shapes that only touch survive it), then the
+    // refinement step keeps the candidates `refine(payload)` accepts.
+    // `refine_stats` counts both steps.
+    template <typename Refine>
+    std::vector<DataT> refinedQuery(const Rectangle& rect, Refine refine, RefineStats& refine_stats) const {
+        std::vector<IndexT> candidates;
+        collectIntersecting(root_index, rect, candidates);
+        for (const auto& entry : ingest_buffer) {
+            if (entry.bounds().intersects(rect)) {
+                candidates.push_back(entry.data_index);
+            }
+        }
+        std::vector<DataT> results;
+        for (IndexT index : candidates) {
+            if (refine(payloads[index])) {
+                results.push_back(payloads[index]);
+            }
+        }
+        refine_stats.candidates += candidates.size();
+        refine_stats.results += results.size();
+        return results;
+    }
+
+    // Refinement against exact shapes: `geometry_of(payload)` returns the
+    // Geometry kept alongside each payload, and an entry is returned when
+    // `predicate` holds between it and `query`.
+    template <typename GeometryOf>
+    std::vector<DataT> refinedQuery(const Geometry& query, GeometryPredicate predicate, GeometryOf geometry_of,
+                                    RefineStats& refine_stats) const {
+        return refinedQuery(
+            query.bounds(), [&](const DataT& data) { return evaluate(predicate, geometry_of(data), query); },
+            refine_stats);
+    }
+
+    // Walks the whole tree once and reports its shape level by level, so
+    // callers can decide when a rebuild (bulkLoad) is worth it.
+    TreeReport analyze() const {
+        TreeReport report;
+        report.entries = entry_count;
+        std::vector<IndexT> level_nodes{root_index};
+        double sibling_overlap = 0;  // overlap among the children of the previous level
+        while (!level_nodes.empty()) {
+            LevelReport level;
+            level.fill_histogram.assign(NodeType::CAPACITY + 1, 0);
+            level.sibling_overlap = sibling_overlap;
+            sibling_overlap = 0;
+
+            std::vector<IndexT> next_level;
+            for (IndexT node_index : level_nodes) {
+                const NodeType& node = nodes[node_index];
+                ++level.nodes;
+                level.entries += node.size();
+                ++level.fill_histogram[node.size()];
+                if (node_index != root_index && node.size() < MIN_ENTRIES) {
+                    ++level.underfull;
+                }
+                if (node.size() == 0) {
+                    continue;
+                }
+
+                Rectangle mbr = nodeMBR(node_index);
+                level.total_area += mbr.area();
+                level.total_margin += mbr.margin();
+
+                std::vector<Rectangle> boxes;
+                if (node.is_leaf) {
+                    for (const auto& entry : node.leaves()) {
+                        boxes.push_back(entry.bounds());
+                    }
+                } else {
+                    for (const auto& entry : node.branches()) {
+                        boxes.push_back(entry.bounding_box);
+                        next_level.push_back(entry.child_index);
+                    }
+                    for (size_t i = 0; i < boxes.size(); ++i) {
+                        for (size_t j = i + 1; j < boxes.size(); ++j) {
+                            sibling_overlap += boxes[i].overlapArea(boxes[j]);
+                        }
+                    }
+                }
+                level.dead_space += std::max(0.0, mbr.area() - unionArea(boxes));
+            }
+
+            report.nodes += level.nodes;
+            report.levels.push_back(level);
+            level_nodes.swap(next_level);
+        }
+        report.height = report.levels.size();
+        return report;
+    }
+
+    // Totals since construction or the last resetStats(). Safe to call
+    // while queries run; each counter is read on its own, so a snapshot
+    // taken mid-query may count part of that query.
+    TreeStats stats() const {
+        return tree_stats.snapshot();
+    }
+
+    void resetStats() {
+        tree_stats = TreeCounters();
+    }
+
+    // The k entries closest to `point`, nearest first. Best-first search
+    // over a queue ordered by minimum distance, so only nodes that could
+    // still hold one of the k nearest entries are opened.
+    std::vector<DataT> nearest(const Point& point, size_t k) const {
+        using Candidate = std::pair<float, IndexT>;  // distance, node index
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> node_queue;
+        std::priority_queue<Candidate> best;  // max-heap of payload indices
+        auto offer = [&](float distance, IndexT data_index) {
+            if (best.size() < k) {
+                best.emplace(distance, data_index);
+            } else if (distance < best.top().first) {
+                best.pop();
+                best.emplace(distance, data_index);
+            }
+        };
+
+        for (const auto& entry : ingest_buffer) {
+            if (k > 0) {
+                offer(entry.bounds().minDistanceSquared(point), entry.data_index);
+            }
+        }
+        node_queue.emplace(0.0f, root_index);
+        while (!node_queue.empty() && k > 0) {
+            Candidate top = node_queue.top();
+            node_queue.pop();
+            if (best.size() == k && top.first > best.top().first) {
+                break;
+            }
+
+            const NodeType& node = nodes[top.second];
+            if (node.is_leaf) {
+                for (const auto& entry : node.leaves()) {
+                    offer(entry.bounds().minDistanceSquared(point), entry.data_index);
+                }
+            } else {
+                for (const auto& entry : node.branches()) {
+                    float distance = entry.bounding_box.minDistanceSquared(point);
+                    if (best.size() < k || distance <= best.top().first) {
+                        node_queue.emplace(distance, entry.child_index);
+                    }
+                }
+            }
+        }
+
+        std::vector<DataT> results;
+        results.reserve(best.size());
+        while (!best.empty()) {
+            results.push_back(payloads[best.top().second]);
+            best.pop();
+        }
+        std::reverse(results.begin(), results.end());
+        return results;
+    }
+
+    // Incremental nearest-neighbour search (Hjaltason and Samet). Each next()
+    // returns the closest entry not returned yet and opens only the nodes
+    // needed to prove that, so callers pull neighbours until their own
+    // condition holds instead of guessing k. A browser reads the tree in
+    // place: it must not outlive it or be used across modifications.
+    class DistanceBrowser {
+    public:
+        DistanceBrowser(const RTree& tree, const Point& point) : tree(&tree), point(point) {
+            for (const auto& entry : tree.ingest_buffer) {
+                queue.push({entry.bounds().minDistanceSquared(point), true, 0, entry.data_index});
+            }
+            queue.push({0.0f, false, 0, tree.root_index});
+        }
+
+        // The next entry by distance and its Euclidean distance from the
+        // query point; false once every entry has been returned.
+        bool next(DataT& data, float& distance) {
+            while (!queue.empty()) {
+                QueueItem top = queue.top();
+                queue.pop();
+                if (top.is_entry) {
+                    data = tree->payloads[top.index];
+                    distance = std::sqrt(top.key);
+                    return true;
+                }
+                const NodeType& node = tree->nodes[top.index];
+                if (node.is_leaf) {
+                    for (const auto& entry : node.leaves()) {
+                        queue.push({entry.bounds().minDistanceSquared(point), true, 0, entry.data_index});
+                    }
+                } else {
+                    for (const auto& entry : node.branches()) {
+                        queue.push({entry.bounding_box.minDistanceSquared(point), false, 0, entry.child_index});
+                    }
+                }
+            }
+            return false;
+        }
+
+        bool next(DataT& data) {
+            float distance;
+            return next(data, distance);
+        }
+
+    private:
+        const RTree* tree;
+        Point point;
+        BestFirstQueue queue;
+    };
+
+    DistanceBrowser browse(const Point& point) const {
+        return DistanceBrowser(*this, point);
+    }
+
+    // All-k-nearest-neighbours: every entry with the k other entries nearest
+    // to it by box-to-box distance, nearest first, in items() order. Entries
+    // are handled a leaf at a time: one best-first traversal serves the
+    // whole leaf and is pruned by the worst k-th distance among its
+    // entries. Leaves are spread over `threads` workers (0 = one per core).
+    std::vector<std::pair<DataT, std::vector<DataT>>> allNearest(size_t k, size_t threads = 0) const {
+        std::vector<std::vector<std::pair<float, IndexT>>> lists = neighbourLists(k, threads);
+        std::vector<LeafEntry<KeyT, IndexT>> records(ingest_buffer);
+        gatherLeafRecords(root_index, records);
+        std::vector<std::pair<DataT, std::vector<DataT>>> out;
+        out.reserve(records.size());
+        for (const auto& record : records) {
+            std::vector<DataT> neighbours;
+            neighbours.reserve(lists[record.data_index].size());
+            for (const auto& neighbour : lists[record.data_index]) {
+                neighbours.push_back(payloads[neighbour.second]);
+            }
+            out.emplace_back(payloads[record.data_index], std::move(neighbours));
+        }
+        return out;
+    }
+
+    // Reverse-k-nearest-neighbour index (RdNN-tree style) over the tree as
+    // it was when built. Each entry keeps the distance to its k-th nearest
+    // other entry and each node the largest such distance below it. An
+    // entry has `point` among its k nearest when `point` lies within that
+    // distance, so a node farther from `point` than its largest distance is
+    // skipped whole. Building costs one allNearest(); rebuild after the
+    // tree changes.
+    class ReverseNearestIndex {
+    public:
+        ReverseNearestIndex(const RTree& tree, size_t k, size_t threads) : tree(&tree) {
+            std::vector<std::vector<std::pair<float, IndexT>>> lists = tree.neighbourLists(k, threads);
+            entry_reach.assign(lists.size(), std::numeric_limits<float>::infinity());
+            for (size_t i = 0; i < lists.size(); ++i) {
+                if (k > 0 && lists[i].size() == k) {
+                    entry_reach[i] = lists[i].back().first;
+                }
+            }
+            node_reach.assign(tree.nodes.size(), 0.0f);
+            computeReach(tree.root_index);
+        }
+
+        // Entries that have `point` among their k nearest neighbours (ties
+        // included). Entries with fewer than k others always qualify.
+        std::vector<DataT> query(const Point& point) const {
+            std::vector<DataT> results;
+            std::vector<IndexT> stack{tree->root_index};
+            while (!stack.empty()) {
+                const NodeType& node = tree->nodes[stack.back()];
+                stack.pop_back();
+                if (node.is_leaf) {
+                    for (const auto& entry : node.leaves()) {
+                        if (entry.bounds().minDistanceSquared(point) <= entry_reach[entry.data_index]) {
+                            results.push_back(tree->payloads[entry.data_index]);
+                        }
+                    }
+                    continue;
+                }
+                for (const auto& entry : node.branches()) {
+                    if (entry.bounding_box.minDistanceSquared(point) <= node_reach[entry.child_index]) {
+                        stack.push_back(entry.child_index);
+                    }
+                }
+            }
+            for (const auto& entry : tree->ingest_buffer) {
+                if (entry.bounds().minDistanceSquared(point) <= entry_reach[entry.data_index]) {
+                    results.push_back(tree->payloads[entry.data_index]);
+                }
+            }
+            return results;
+        }
+
+        // query() for each point, spread over `threads` workers.
+        std::vector<std::vector<DataT>> query(const std::vector<Point>& points, size_t threads = 0) const {
+            std::vector<std::vector<DataT>> results(points.size());
+            parallelFor(points.size(), threads, [&](size_t i) { results[i] = query(points[i]); });
+            return results;
+        }
+
+    private:
+        float computeReach(IndexT node_index) {
+            const NodeType& node = tree->nodes[node_index];
+            float reach = 0.0f;
+            if (node.is_leaf) {
+                for (const auto& entry : node.leaves()) {
+                    reach = std::max(reach, entry_reach[entry.data_index]);
+                }
+            } else {
+                for (const auto& entry : node.branches()) {
+                    reach = std::max(reach, computeReach(entry.child_index));
+                }
+            }
+            node_reach[node_index] = reach;
+            return reach;
+        }
+
+        const RTree* tree;
+        std::vector<float> entry_reach;  // squared k-th neighbour distance, by payload index
+        std::vector<float> node_reach;   // largest entry_reach in the subtree, by node index
+    };
+
+    ReverseNearestIndex reverseNearestIndex(size_t k, size_t threads = 0) const {
+        return ReverseNearestIndex(*this, k, threads);
+    }
+
+    // Result-size estimate for rangeQuery() from the tree's upper levels,
+    // for choosing between an index scan and a full scan. The synopsis is
+    // the deepest level with at most `budget` nodes; each node keeps its
+    // subtree count, the box of its entries' centres and their mean half
+    // extents. An entry meets the query exactly when its centre lies in the
+    // query grown by its half extents, so a node contributes its count times
+    // the share of its centre box inside that grown query, assuming centres
+    // spread evenly. Built in one pass over the tree; it does not follow
+    // later changes, so rebuild once the tree has drifted.
+    class SelectivityEstimator {
+    public:
+        SelectivityEstimator(const RTree& tree, size_t budget) {
+            std::vector<size_t> level_nodes;
+            countLevels(tree, tree.root_index, 0, level_nodes);
+            size_t cut = 0;
+            while (cut + 1 < level_nodes.size() && level_nodes[cut + 1] <= budget) {
+                ++cut;
+            }
+            addCells(tree, tree.root_index, 0, cut);
+            for (const auto& entry : tree.ingest_buffer) {
+                Summary summary;
+                summary.add(entry.bounds());
+                addCell(summary);
+            }
+        }
+
+        double estimateCount(const Rectangle& rect) const {
+            double total = 0.0;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                float x_lo = std::max(x_min[i], rect.x_min - half_width[i]);
+                float x_hi = std::min(x_max[i], rect.x_max + half_width[i]);
+                float y_lo = std::max(y_min[i], rect.y_min - half_height[i]);
+                float y_hi = std::min(y_max[i], rect.y_max + half_height[i]);
+                // A flat centre box has inverse extent 0 and flatness 1, so
+                // any overlap at all counts as full coverage on that axis.
+                float share_x = (x_hi - x_lo) * inverse_width[i] + flat_x[i];
+                float share_y = (y_hi - y_lo) * inverse_height[i] + flat_y[i];
+                share_x = x_hi < x_lo ? 0.0f : share_x;
+                share_y = y_hi < y_lo ? 0.0f : share_y;
+                total += static_cast<double>(counts[i]) * share_x * share_y;
+            }
+            return total;
+        }
+
+        // Number of synopsis cells an estimate sums over.
+        size_t cells() const {
+            return counts.size();
+        }
+
+    private:
+        // Running summary of the entries below one synopsis node.
+        struct Summary {
+            Rectangle centres{std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                              std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest()};
+            double width_sum = 0.0, height_sum = 0.0;
+            size_t count = 0;
+
+            void add(const Rectangle& box) {
+                float cx = 0.5f * (box.x_min + box.x_max), cy = 0.5f * (box.y_min + box.y_max);
+                centres.expand(Rectangle(cx, cy, cx, cy));
+                width_sum += box.x_max - box.x_min;
+                height_sum += box.y_max - box.y_min;
+                ++count;
+            }
+        };
+
+        static void countLevels(const RTree& tree, IndexT node_index, size_t depth,
+                                std::vector<size_t>& level_nodes) {
+            if (level_nodes.size() <= depth) {
+                level_nodes.resize(depth + 1, 0);
+            }
+            ++level_nodes[depth];
+            const NodeType& node = tree.nodes[node_index];
+            if (!node.is_leaf) {
+                for (const auto& entry : node.branches()) {
+                    countLevels(tree, entry.child_index, depth + 1, level_nodes);
+                }
+            }
+        }
+
+        // One cell per node at depth `cut`.
+        void addCells(const RTree& tree, IndexT node_index, size_t depth, size_t cut) {
+            const NodeType& node = tree.nodes[node_index];
+            if (depth < cut && !node.is_leaf) {
+                for (const auto& entry : node.branches()) {
+                    addCells(tree, entry.child_index, depth + 1, cut);
+                }
+                return;
+            }
+            Summary summary;
+            fold(tree, node_index, summary);
+            addCell(summary);
+        }
+
+        static void fold(const RTree& tree, IndexT node_index, Summary& summary) {
+            const NodeType& node = tree.nodes[node_index];
+            if (node.is_leaf) {
+                for (const auto& entry : node.leaves()) {
+                    summary.add(entry.bounds());
+                }
+                return;
+            }
+            for (const auto& entry : node.branches()) {
+                fold(tree, entry.child_index, summary);
+            }
+        }
+
+        void addCell(const Summary& summary) {
+            if (summary.count == 0) {
+                return;
+            }
+            float width = summary.centres.x_max - summary.centres.x_min;
+            float height = summary.centres.y_max - summary.centres.y_min;
+            x_min.push_back(summary.centres.x_min);
+            y_min.push_back(summary.centres.y_min);
+            x_max.push_back(summary.centres.x_max);
+            y_max.push_back(summary.centres.y_max);
+            half_width.push_back(static_cast<float>(0.5 * summary.width_sum / summary.count));
+            half_height.push_back(static_cast<float>(0.5 * summary.height_sum / summary.count));
+            inverse_width.push_back(width > 0.0f ? 1.0f / width : 0.0f);
+            inverse_height.push_back(height > 0.0f ? 1.0f / height : 0.0f);
+            flat_x.push_back(width > 0.0f ? 0.0f : 1.0f);
+            flat_y.push_back(height > 0.0f ? 0.0f : 1.0f);
+            counts.push_back(static_cast<uint32_t>(summary.count));
+        }
+
+        std::vector<float> x_min, y_min, x_max, y_max;  // box of the entry centres
+        std::vector<float> half_width, half_height;     // mean entry half extents
+        std::vector<float> inverse_width, inverse_height, flat_x, flat_y;
+        std::vector<uint32_t> counts;
+    };
+
+    SelectivityEstimator selectivityEstimator(size_t budget = 1024) const {
+        return SelectivityEstimator(*this, budget);
+    }
+
+    // Number of entries currently stored.
+    size_t size() const {
+        return entry_count;
+    }
+
+    // Every stored (key, payload) pair, in tree order.
+    std::vector<std::pair<KeyT, DataT>> items() const {
+        std::vector<std::pair<KeyT, DataT>> out;
+        out.reserve(entry_count);
+        for (const auto& entry : ingest_buffer) {
+            out.emplace_back(entry.key, payloads[entry.data_index]);
+        }
+        std::vector<IndexT> stack{root_index};
+        while (!stack.empty()) {
+            const NodeType& node = nodes[stack.back()];
+            stack.pop_back();
+            if (node.is_leaf) {
+                for (const auto& entry : node.leaves()) {
+                    out.emplace_back(entry.key, payloads[entry.data_index]);
+                }
+            } else {
+                for (const auto& entry : node.branches()) {
+                    stack.push_back(entry.child_index);
+                }
+            }
+        }
+        return out;
+    }
+
+    // Number of levels, counting the leaf level. All leaves are at the
+    // same depth, so following the first child is enough.
+    size_t height() const {
+        size_t levels = 1;
+        for (IndexT index = root_index; !nodes[index].is_leaf; index = nodes[index].entries[0].child_index) {
+            ++levels;
+        }
+        return levels;
+    }
+
+    // Rewrites the node array in the given order (root first) and remaps
+    // every child_index. Meant for read-mostly snapshots: a root-to-leaf
+    // path then touches nearby memory. Later inserts still work but append
+    // nodes at the end.
+    void relayout(NodeLayout layout = NodeLayout::VanEmdeBoas) {
+        std::vector<IndexT> order;
+        order.reserve(nodes.size());
+        if (layout == NodeLayout::BreadthFirst) {
+            breadthFirstOrder(order);
+        } else {
+            vanEmdeBoasOrder(root_index, height(), order);
+        }
+
+        std::vector<IndexT> new_index(nodes.size(), INVALID_INDEX<IndexT>);
+        for (size_t i = 0; i < order.size(); ++i) {
+            new_index[order[i]] = static_cast<IndexT>(i);
+        }
+
+        NodeArena<NodeType, IndexT> relaid;
+        for (IndexT old_index : order) {
+            NodeType& node = relaid[relaid.allocate(true)];
+            node = nodes[old_index];
+            if (!node.is_leaf) {
+                for (auto& entry : node.branches()) {
+                    entry.child_index = new_index[entry.child_index];
+                }
+            }
+        }
+        nodes = std::move(relaid);
+        root_index = 0;
+    }
+
+private:
+    template <typename, typename, typename>
+    friend class LatchedRTree;
+
+    IndexT storePayload(const DataT& data) {
+        if (!free_payloads.empty()) {
+            IndexT index = free_payloads.back();
+            free_payloads.pop_back();
+            payloads[index] = data;
+            return index;
+        }
+        if (payloads.size() >= INVALID_INDEX<IndexT>) {
+            throw std::length_error("Payload index overflow");
+        }
+        payloads.push_back(data);
+        return static_cast<IndexT>(payloads.size() - 1);
+    }
+
+    IndexT createNode(bool is_leaf) {
+        return nodes.allocate(is_leaf);
+    }
+
+    // Places a leaf record whose payload is already stored.
+    void insertEntry(const LeafEntry<KeyT, IndexT>& entry) {
+        std::vector<IndexT> path;
+        IndexT leaf_index = chooseLeaf(root_index, entry.bounds(), path);
+        NodeType& leaf = nodes[leaf_index];
+        leaf.push(entry);
+
+        if (leaf.size() > MAX_ENTRIES) {
+            if constexpr (STATS_ENABLED) {
+                auto start = std::chrono::steady_clock::now();
+                splitNode(leaf_index, path);
+                tree_stats.split_nanoseconds.fetch_add(static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count()), std::memory_order_relaxed);
+            } else {
+                splitNode(leaf_index, path);
+            }
+        }
+    }
+
+    // Batched insertion of leaf records whose payloads are already stored.
+    void insertLeafRecords(std::vector<LeafEntry<KeyT, IndexT>>& records) {
+        if (records.empty()) {
+            return;
+        }
+        BatchState state;
+        state.bounds = computeMBR(records);
+        if (nodes[root_index].size() > 0) {
+            state.bounds.expand(nodeMBR(root_index));
+        }
+        state.choice.resize(records.size());
+        state.scratch.resize(records.size());
+        insertGroup(root_index, records.data(), records.size(), state);
+        if (state.siblings.empty()) {
+            return;
+        }
+        const Rectangle& bounds = state.bounds;
+        std::vector<BranchEntry<IndexT>>& siblings = state.siblings;
+        // The root split: stack new levels until one node holds them all.
+        siblings.insert(siblings.begin(), BranchEntry<IndexT>(nodeMBR(root_index), root_index));
+        while (siblings.size() > MAX_ENTRIES) {
+            IndexT holder = createNode(false);
+            std::vector<BranchEntry<IndexT>> level(1);
+            redistribute(holder, siblings, bounds, level);
+            level[0] = BranchEntry<IndexT>(nodeMBR(holder), holder);
+            siblings = std::move(level);
+        }
+        root_index = createNode(false);
+        for (const auto& entry : siblings) {
+            nodes[root_index].push(entry);
+        }
+    }
+
+    // Scratch shared by one insertLeafRecords call. `siblings` is a stack:
+    // children push the new siblings they split into above their caller's,
+    // and the caller absorbs them before pushing its own.
+    struct BatchState {
+        Rectangle bounds;
+        std::vector<BranchEntry<IndexT>> siblings;
+        // Child slot per record: a byte while a node's slots fit in one.
+        using ChildSlot = std::conditional_t<(NodeType::CAPACITY <= 256), uint8_t, IndexT>;
+        std::vector<ChildSlot> choice;
+        std::vector<LeafEntry<KeyT, IndexT>> scratch;
+    };
+
+    // Adds records[0, count) to the subtree at `node_index` and pushes any
+    // new siblings the node splits into. The range is regrouped in place by
+    // target child and each group descends once.
+    void insertGroup(IndexT node_index, LeafEntry<KeyT, IndexT>* records, size_t count, BatchState& state) {
+        const Rectangle& bounds = state.bounds;
+        std::vector<BranchEntry<IndexT>>& siblings = state.siblings;
+        NodeType& node = nodes[node_index];
+        if (node.is_leaf) {
+            if (node.size() + count <= NodeType::CAPACITY) {
+                for (size_t i = 0; i < count; ++i) {
+                    node.push(records[i]);
+                }
+                if (node.size() > MAX_ENTRIES) {
+                    siblings.push_back(splitOff(node_index));
+                }
+                return;
+            }
+            std::vector<LeafEntry<KeyT, IndexT>> all(node.leaves().begin(), node.leaves().end());
+            all.insert(all.end(), records, records + count);
+            redistribute(node_index, all, bounds, siblings);
+            return;
+        }
+
+        // Counting sort by target child, with children chosen against the
+        // boxes as they were on arrival.
+        size_t child_count = node.size();
+        size_t group_begin[NodeType::CAPACITY + 1] = {};
+        for (size_t i = 0; i < count; ++i) {
+            state.choice[i] = static_cast<typename BatchState::ChildSlot>(chooseSubtree(node, records[i].bounds()));
+            ++group_begin[state.choice[i] + 1];
+        }
+        for (size_t i = 0; i < child_count; ++i) {
+            group_begin[i + 1] += group_begin[i];
+        }
+        if (count > 1) {
+            size_t next[NodeType::CAPACITY];
+            std::copy(group_begin, group_begin + child_count, next);
+            for (size_t i = 0; i < count; ++i) {
+                state.scratch[next[state.choice[i]]++] = records[i];
+            }
+            std::copy(state.scratch.begin(), state.scratch.begin() + static_cast<std::ptrdiff_t>(count), records);
+        }
+
+        size_t mark = siblings.size();
+        for (size_t i = 0; i < child_count; ++i) {
+            size_t group_size = group_begin[i + 1] - group_begin[i];
+            if (group_size == 0) {
+                continue;
+            }
+            IndexT child_index = node.entries[i].child_index;
+            insertGroup(child_index, records + group_begin[i], group_size, state);
+            node.entries[i].bounding_box = nodeMBR(child_index);
+        }
+
+        size_t added = siblings.size() - mark;
+        if (node.size() + added <= NodeType::CAPACITY) {
+            for (size_t i = mark; i < siblings.size(); ++i) {
+                node.push(siblings[i]);
+            }
+            siblings.resize(mark);
+            if (node.size() > MAX_ENTRIES) {
+                siblings.push_back(splitOff(node_index));
+            }
+            return;
+        }
+        std::vector<BranchEntry<IndexT>> all(node.branches().begin(), node.branches().end());
+        all.insert(all.end(), siblings.begin() + static_cast<std::ptrdiff_t>(mark), siblings.end());
+        siblings.resize(mark);
+        redistribute(node_index, all, bounds, siblings);
+    }
+
+    // Multi-way split for a node more than one record over capacity: lays
+    // `all` out over as few nodes as fit it, sized evenly so each stays at
+    // or above MIN_ENTRIES. Two parts are cut across the longer axis; more
+    // follow the Hilbert curve. The first part reuses `node_index`; the rest
+    // are appended to `siblings`.
+    template <typename EntryT>
+    void redistribute(IndexT node_index, std::vector<EntryT>& all, const Rectangle& bounds,
+                      std::vector<BranchEntry<IndexT>>& siblings) {
+        if constexpr (STATS_ENABLED) {
+            tree_stats.splits.fetch_add(1, std::memory_order_relaxed);
+        }
+        size_t parts = (all.size() + MAX_ENTRIES - 1) / MAX_ENTRIES;
+        if (parts == 2) {
+            Rectangle extent = computeMBR(all);
+            bool by_x = extent.x_max - extent.x_min >= extent.y_max - extent.y_min;
+            std::sort(all.begin(), all.end(), [by_x](const EntryT& a, const EntryT& b) {
+                Rectangle box_a = a.bounds(), box_b = b.bounds();
+                return by_x ? box_a.x_min + box_a.x_max < box_b.x_min + box_b.x_max
+                            : box_a.y_min + box_a.y_max < box_b.y_min + box_b.y_max;
+            });
+        } else {
+            sortByHilbert(all, bounds);
+        }
+        bool is_leaf = nodes[node_index].is_leaf;
+        size_t begin = 0;
+        for (size_t part = 0; part < parts; ++part) {
+            size_t end = begin + (all.size() - begin) / (parts - part);
+            IndexT target = part == 0 ? node_index : createNode(is_leaf);
+            NodeType& node = nodes[target];
+            node = NodeType(is_leaf);
+            for (size_t i = begin; i < end; ++i) {
+                node.push(all[i]);
+            }
+            if (part > 0) {
+                siblings.emplace_back(nodeMBR(target), target);
+            }
+            begin = end;
+        }
+    }
+
+    template <typename EntryT>
+    static void sortByHilbert(std::vector<EntryT>& entries, const Rectangle& bounds) {
+        std::vector<std::pair<uint64_t, EntryT>> keyed;
+        keyed.reserve(entries.size());
+        for (const auto& entry : entries) {
+            keyed.emplace_back(hilbertKey(entry.bounds(), bounds), entry);
+        }
+        std::sort(keyed.begin(), keyed.end(),
+                  [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (size_t i = 0; i < keyed.size(); ++i) {
+            entries[i] = keyed[i].second;
+        }
+    }
+
+    // Builds the node levels over `leaf_records` and makes the result the
+    // root. The arena must already be empty.
+    void packLeafRecords(std::vector<LeafEntry<KeyT, IndexT>>& leaf_records,
+                         PackingOrder order = PackingOrder::SortTileRecursive) {
+        if (leaf_records.empty()) {
+            root_index = createNode(true);
+            return;
+        }
+        std::vector<BranchEntry<IndexT>> level = packLevel(leaf_records, true, order);
+        while (level.size() > 1) {
+            level = packLevel(level, false, order);
+        }
+        root_index = level[0].child_index;
+    }
+
+    void gatherLeafRecords(IndexT node_index, std::vector<LeafEntry<KeyT, IndexT>>& out) const {
+        const NodeType& node = nodes[node_index];
+        if (node.is_leaf) {
+            out.insert(out.end(), node.leaves().begin(), node.leaves().end());
+            return;
+        }
+        for (const auto& entry : node.branches()) {
+            gatherLeafRecords(entry.child_index, out);
+        }
+    }
+
+    // Packs one level bottom-up: orders the entries (STR: slices by x, each
+    // slice by y; Hilbert: by curve position) and fills nodes of MAX_ENTRIES
+    // in that order.
+    template <typename EntryT>
+    std::vector<BranchEntry<IndexT>> packLevel(std::vector<EntryT>& entries, bool leaf_level, PackingOrder order) {
+        if (order == PackingOrder::Hilbert) {
+            sortByHilbert(entries, computeMBR(entries));
+            return packRun(entries, 0, entries.size(), leaf_level);
+        }
+
+        auto center_x = [](const EntryT& entry) {
+            Rectangle box = entry.bounds();
+            return box.x_min + box.x_max;
+        };
+        auto center_y = [](const EntryT& entry) {
+            Rectangle box = entry.bounds();
+            return box.y_min + box.y_max;
+        };
+
+        size_t node_count = (entries.size() + MAX_ENTRIES - 1) / MAX_ENTRIES;
+        size_t slice_count = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(node_count))));
+        size_t slice_size = slice_count * MAX_ENTRIES;
+
+        std::sort(entries.begin(), entries.end(),
+                  [&](const EntryT& a, const EntryT& b) { return center_x(a) < center_x(b); });
+
+        std::vector<BranchEntry<IndexT>> parents;
+        parents.reserve(node_count);
+        for (size_t slice_begin = 0; slice_begin < entries.size(); slice_begin += slice_size) {
+            size_t slice_end = std::min(slice_begin + slice_size, entries.size());
+            std::sort(entries.begin() + slice_begin, entries.begin() + slice_end,
+                      [&](const EntryT& a, const EntryT& b) { return center_y(a) < center_y(b); });
+            std::vector<BranchEntry<IndexT>> slice = packRun(entries, slice_begin, slice_end, leaf_level);
+            parents.insert(parents.end(), slice.begin(), slice.end());
+        }
+        return parents;
+    }
+
+    // Fills consecutive nodes of MAX_ENTRIES from entries[first, last).
+    template <typename EntryT>
+    std::vector<BranchEntry<IndexT>> packRun(const std::vector<EntryT>& entries, size_t first, size_t last,
+                                             bool leaf_level) {
+        std::vector<BranchEntry<IndexT>> parents;
+        parents.reserve((last - first + MAX_ENTRIES - 1) / MAX_ENTRIES);
+        for (size_t begin = first; begin < last; begin += MAX_ENTRIES) {
+            IndexT node_index = createNode(leaf_level);
+            NodeType& node = nodes[node_index];
+            for (size_t i = begin; i < std::min(begin + MAX_ENTRIES, last); ++i) {
+                node.push(entries[i]);
+            }
+            parents.emplace_back(nodeMBR(node_index), node_index);
+        }
+        return parents;
+    }
+
+    // Finds the leaf holding (key, data); returns INVALID_INDEX if absent.
+    // On success `path` holds the internal nodes above it and `slot` the
+    // record's position in the leaf.
+    IndexT findLeaf(IndexT node_index, const KeyT& key, const DataT& data,
+                    std::vector<IndexT>& path, size_t& slot) const {
+        const NodeType& node = nodes[node_index];
+        if (node.is_leaf) {
+            for (size_t i = 0; i < node.size(); ++i) {
+                const auto& entry = node.leaf_entries[i];
+                if (entry.key == key && payloads[entry.data_index] == data) {
+                    slot = i;
+                    return node_index;
+                }
+            }
+            return INVALID_INDEX<IndexT>;
+        }
+
+        Rectangle box = boundsOf(key);
+        path.push_back(node_index);
+        for (const auto& entry : node.branches()) {
+            if (entry.bounding_box.contains(box)) {
+                IndexT leaf_index = findLeaf(entry.child_index, key, data, path, slot);
+                if (leaf_index != INVALID_INDEX<IndexT>) {
+                    return leaf_index;
+                }
+            }
+        }
+        path.pop_back();
+        return INVALID_INDEX<IndexT>;
+    }
+
+    // Walks from a leaf that just lost an entry back to the root, tightening
+    // boxes and detaching nodes that fell below MIN_ENTRIES. Entries under
+    // detached nodes are reinserted once the tree is consistent again.
+    void condenseTree(IndexT node_index, std::vector<IndexT>& path) {
+        std::vector<IndexT> orphans;
+        while (node_index != root_index) {
+            IndexT parent_index = path.back();
+            path.pop_back();
+            NodeType& parent = nodes[parent_index];
+            for (size_t i = 0; i < parent.size(); ++i) {
+                if (parent.entries[i].child_index != node_index) {
+                    continue;
+                }
+                if (nodes[node_index].size() < MIN_ENTRIES) {
+                    parent.erase(i);
+                    orphans.push_back(node_index);
+                } else {
+                    parent.entries[i].bounding_box = nodeMBR(node_index);
+                }
+                break;
+            }
+            node_index = parent_index;
+        }
+
+        while (!nodes[root_index].is_leaf && nodes[root_index].size() == 1) {
+            IndexT old_root = root_index;
+            root_index = nodes[old_root].entries[0].child_index;
+            nodes.release(old_root);
+        }
+        if (!nodes[root_index].is_leaf && nodes[root_index].size() == 0) {
+            nodes[root_index] = NodeType(true);
+        }
+
+        std::vector<LeafEntry<KeyT, IndexT>> reinserts;
+        for (IndexT orphan : orphans) {
+            releaseSubtree(orphan, reinserts);
+        }
+        for (const auto& entry : reinserts) {
+            insertEntry(entry);
+        }
+    }
+
+    // Frees every node under `node_index`, collecting its leaf records.
+    void releaseSubtree(IndexT node_index, std::vector<LeafEntry<KeyT, IndexT>>& leaf_records) {
+        const NodeType& node = nodes[node_index];
+        if (node.is_leaf) {
+            leaf_records.insert(leaf_records.end(), node.leaves().begin(), node.leaves().end());
+        } else {
+            for (const auto& entry : node.branches()) {
+                releaseSubtree(entry.child_index, leaf_records);
+            }
+        }
+        nodes.release(node_index);
+    }
+
+    // Descends to the leaf that needs the least enlargement, recording the
+    // internal nodes it passes through in `path` for splitNode.
+    IndexT chooseLeaf(IndexT node_index, const Rectangle& rect, std::vector<IndexT>& path) {
+        NodeType& node = nodes[node_index];
+
+        if (node.is_leaf) {
+            return node_index;
+        }
+        path.push_back(node_index);
+
+        size_t best_index = chooseSubtree(node, rect);
+        node.entries[best_index].bounding_box.expand(rect);
+        IndexT child_index = node.entries[best_index].child_index;
+        return chooseLeaf(child_index, rect, path);
+    }
+
+    // The child of an internal node whose box grows least to take `rect`.
+    static size_t chooseSubtree(const NodeType& node, const Rectangle& rect) {
+        size_t best_index = 0;
+        float min_area_increase = std::numeric_limits<float>::max();
+        for (size_t i = 0; i < node.size(); ++i) {
+            const Rectangle& entry_rect = node.entries[i].bounding_box;
+            float area_before = entry_rect.area();
+            Rectangle expanded_rect = entry_rect;
+            expanded_rect.expand(rect);
+            float area_increase = expanded_rect.area() - area_before;
+            if (area_increase < min_area_increase) {
+                min_area_increase = area_increase;
+                best_index = i;
+            }
+        }
+        return best_index;
+    }
+
+    template <typename RangeT>
+    static Rectangle computeMBR(const RangeT& entries) {
+        Rectangle mbr = entries[0].bounds();
+        for (size_t i = 1; i < entries.size(); ++i) {
+            mbr.expand(entries[i].bounds());
+        }
+        return mbr;
+    }
+
+    // Quadratic split shared by leaf and internal nodes: moves part of the
+    // `count` records in `entries` into the empty array `new_entries`.
+    template <typename EntryT>
+    static void quadraticSplit(EntryT* entries, uint16_t& count,
+                               EntryT* new_entries, uint16_t& new_count) {
+        size_t seed1 = 0, seed2 = 1;
+        float max_area_diff = -1.0f;
+
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t j = i + 1; j < count; ++j) {
+                Rectangle box_i = entries[i].bounds();
+                Rectangle box_j = entries[j].bounds();
+                Rectangle combined = box_i;
+                combined.expand(box_j);
+
+                float area_diff = combined.area() - box_i.area() - box_j.area();
+
+                if (area_diff > max_area_diff) {
+                    max_area_diff = area_diff;
+                    seed1 = i;
+                    seed2 = j;
+                }
+            }
+        }
+
+        EntryT remaining_entries[NodeType::CAPACITY];
+        size_t remaining_count = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (i != seed1 && i != seed2) {
+                remaining_entries[remaining_count++] = entries[i];
+            }
+        }
+
+        EntryT seed1_entry = entries[seed1];
+        EntryT seed2_entry = entries[seed2];
+        entries[0] = seed1_entry;
+        count = 1;
+        new_entries[0] = seed2_entry;
+        new_count = 1;
+
+        for (size_t k = 0; k < remaining_count; ++k) {
+            const EntryT& entry = remaining_entries[k];
+            Rectangle rect1 = entries[0].bounds();
+            Rectangle rect2 = new_entries[0].bounds();
+            Rectangle expanded1 = rect1;
+            Rectangle expanded2 = rect2;
+            expanded1.expand(entry.bounds());
+            expanded2.expand(entry.bounds());
+            float area_increase1 = expanded1.area() - rect1.area();
+            float area_increase2 = expanded2.area() - rect2.area();
+            if (area_increase1 < area_increase2) {
+                entries[count++] = entry;
+            } else {
+                new_entries[new_count++] = entry;
+            }
+        }
+    }
+
+    Rectangle nodeMBR(IndexT node_index) const {
+        const NodeType& node = nodes[node_index];
+        return node.is_leaf ? computeMBR(node.leaves()) : computeMBR(node.branches());
+    }
+
+    // Quadratic split of an overflowing node into itself and a new sibling,
+    // returned as the entry the parent should gain.
+    BranchEntry<IndexT> splitOff(IndexT node_index) {
+        return splitInto(node_index, createNode(nodes[node_index].is_leaf));
+    }
+
+    // splitOff() into a node the caller has already allocated, as
+    // LatchedRTree does under its own allocation lock.
+    BranchEntry<IndexT> splitInto(IndexT node_index, IndexT new_node_index) {
+        if constexpr (STATS_ENABLED) {
+            tree_stats.splits.fetch_add(1, std::memory_order_relaxed);
+        }
+        NodeType& node = nodes[node_index];
+        NodeType& new_node = nodes[new_node_index];
+        if (node.is_leaf) {
+            quadraticSplit(node.leaf_entries, node.count, new_node.leaf_entries, new_node.count);
+        } else {
+            quadraticSplit(node.entries, node.count, new_node.entries, new_node.count);
+        }
+        return BranchEntry<IndexT>(nodeMBR(new_node_index), new_node_index);
+    }
+
+    void splitNode(IndexT node_index, std::vector<IndexT>& path) {
+        BranchEntry<IndexT> sibling = splitOff(node_index);
+        if (node_index == root_index) {
+            root_index = createNode(false);
+            NodeType& root = nodes[root_index];
+            root.push(BranchEntry<IndexT>(nodeMBR(node_index), node_index));
+            root.push(sibling);
+        } else {
+            IndexT parent_index = path.back();
+            path.pop_back();
+            NodeType& parent = nodes[parent_index];
+            for (auto& entry : parent.branches()) {
+                if (entry.child_index == node_index) {
+                    entry.bounding_box = nodeMBR(node_index);
+                    break;
+                }
+            }
+
+            parent.push(sibling);
+            if (parent.size() > MAX_ENTRIES) {
+                splitNode(parent_index, path);
+            }
+        }
+    }
+
+
+    void breadthFirstOrder(std::vector<IndexT>& order) const {
+        order.push_back(root_index);
+        for (size_t i = 0; i < order.size(); ++i) {
+            const NodeType& node = nodes[order[i]];
+            if (!node.is_leaf) {
+                for (const auto& entry : node.branches()) {
+                    order.push_back(entry.child_index);
+                }
+            }
+        }
+    }
+
+    // Van Emde Boas layout: lay out the top half of the levels recursively,
+    // then each subtree hanging below it, so any root-to-leaf path crosses
+    // O(log_B n) blocks whatever the block size.
+    void vanEmdeBoasOrder(IndexT subtree_root, size_t levels, std::vector<IndexT>& order) const {
+        if (levels == 1) {
+            order.push_back(subtree_root);
+            return;
+        }
+        size_t top_levels = levels / 2;
+        vanEmdeBoasOrder(subtree_root, top_levels, order);
+
+        std::vector<IndexT> bottom_roots;
+        collectAtDepth(subtree_root, top_levels, bottom_roots);
+        for (IndexT bottom_root : bottom_roots) {
+            vanEmdeBoasOrder(bottom_root, levels - top_levels, order);
+        }
+    }
+
+    void collectAtDepth(IndexT node_index, size_t depth, std::vector<IndexT>& out) const {
+        if (depth == 0) {
+            out.push_back(node_index);
+            return;
+        }
+        for (const auto& entry : nodes[node_index].branches()) {
+            collectAtDepth(entry.child_index, depth - 1, out);
+        }
+    }
+
+    void rangeQueryHelper(IndexT node_index, const Rectangle& rect, std::vector<DataT>& results,
+                          QueryStats& query_stats, size_t depth) const {
+        const NodeType& node = nodes[node_index];
+        if constexpr (STATS_ENABLED) {
+            query_stats.recordVisit(depth);
+            query_stats.entries_tested += node.size();
+        }
+
+        if (node.is_leaf) {
+            for (const auto& entry : node.leaves()) {
+                if (keyMatches(entry.key, rect)) {
+                    results.push_back(payloads[entry.data_index]);
+                    if constexpr (STATS_ENABLED) {
+                        ++query_stats.leaf_results;
+                    }
+                }
+            }
+            return;
+        }
+
+        for (const auto& entry : node.branches()) {
+            if (entry.bounding_box.intersects(rect)) {
+                [[maybe_unused]] size_t results_before = results.size();
+                rangeQueryHelper(entry.child_index, rect, results, query_stats, depth + 1);
+                if constexpr (STATS_ENABLED) {
+                    ++query_stats.overlap_hits;
+                    if (results.size() == results_before) {
+                        ++query_stats.false_descents;
+                    }
+                }
+            }
+        }
+    }
+
+    // Shared body of the predicate queries: `descend(box)` decides whether a
+    // child may hold matches, `match(box)` whether a key is one. With
+    // `whole_subtrees`, matching is inherited by every box inside a match,
+    // so a node whose own box matches is reported without further tests.
+    template <typename Descend, typename Match>
+    std::vector<DataT> predicateQuery(Descend descend, Match match, bool whole_subtrees,
+                                      QueryStats& query_stats) const {
+        std::vector<DataT> results;
+        predicateQueryHelper(root_index, descend, match, whole_subtrees, results, query_stats, 0);
+        for (const auto& entry : ingest_buffer) {
+            if (match(entry.bounds())) {
+                results.push_back(payloads[entry.data_index]);
+            }
+        }
+        if constexpr (STATS_ENABLED) {
+            tree_stats.addQuery(query_stats);
+        }
+        return results;
+    }
+
+    template <typename Descend, typename Match>
+    void predicateQueryHelper(IndexT node_index, Descend& descend, Match& match, bool whole_subtrees,
+                              std::vector<DataT>& results, QueryStats& query_stats, size_t depth) const {
+        const NodeType& node = nodes[node_index];
+        if constexpr (STATS_ENABLED) {
+            query_stats.recordVisit(depth);
+            query_stats.entries_tested += node.size();
+        }
+
+        if (node.is_leaf) {
+            for (const auto& entry : node.leaves()) {
+                if (match(entry.bounds())) {
+                    results.push_back(payloads[entry.data_index]);
+                    if constexpr (STATS_ENABLED) {
+                        ++query_stats.leaf_results;
+                    }
+                }
+            }
+            return;
+        }
+
+        for (const auto& entry : node.branches()) {
+            if (whole_subtrees && match(entry.bounding_box)) {
+                std::vector<LeafEntry<KeyT, IndexT>> leaf_records;
+                gatherLeafRecords(entry.child_index, leaf_records);
+                for (const auto& record : leaf_records) {
+                    results.push_back(payloads[record.data_index]);
+                }
+                if constexpr (STATS_ENABLED) {
+                    query_stats.leaf_results += leaf_records.size();
+                }
+            } else if (descend(entry.bounding_box)) {
+                if constexpr (STATS_ENABLED) {
+                    ++query_stats.overlap_hits;
+                }
+                predicateQueryHelper(entry.child_index, descend, match, whole_subtrees, results, query_stats,
+                                     depth + 1);
+            }
+        }
+    }
+
+    // For every entry, its k nearest other entries as (squared distance,
+    // payload index), nearest first, indexed by payload index. Leaves and
+    // chunks of the ingest buffer are the groups handed to groupNearest().
+    std::vector<std::vector<std::pair<float, IndexT>>> neighbourLists(size_t k, size_t threads) const {
+        struct Group {
+            const LeafEntry<KeyT, IndexT>* records;
+            size_t count;
+        };
+        std::vector<Group> groups;
+        std::vector<IndexT> stack{root_index};
+        while (!stack.empty()) {
+            const NodeType& node = nodes[stack.back()];
+            stack.pop_back();
+            if (node.is_leaf) {
+                if (node.size() > 0) {
+                    groups.push_back({node.leaf_entries, node.size()});
+                }
+                continue;
+            }
+            for (const auto& entry : node.branches()) {
+                stack.push_back(entry.child_index);
+            }
+        }
+        for (size_t i = 0; i < ingest_buffer.size(); i += MAX_ENTRIES) {
+            groups.push_back({&ingest_buffer[i], std::min(MAX_ENTRIES, ingest_buffer.size() - i)});
+        }
+
+        std::vector<std::vector<std::pair<float, IndexT>>> lists(payloads.size());
+        if (k > 0) {
+            parallelFor(groups.size(), threads,
+                        [&](size_t g) { groupNearest(groups[g].records, groups[g].count, k, lists); });
+        }
+        return lists;
+    }
+
+    // One best-first traversal for a group of up to CAPACITY records. Nodes
+    // are ordered by distance to the group's box and cut off once farther
+    // than the worst k-th distance of any record in the group.
+    void groupNearest(const LeafEntry<KeyT, IndexT>* group, size_t count, size_t k,
+                      std::vector<std::vector<std::pair<float, IndexT>>>& lists) const {
+        using Neighbour = std::pair<float, IndexT>;
+        assert(count <= NodeType::CAPACITY);
+        Rectangle boxes[NodeType::CAPACITY];
+        std::priority_queue<Neighbour> best[NodeType::CAPACITY];  // max-heaps
+        Rectangle group_box = group[0].bounds();
+        for (size_t j = 0; j < count; ++j) {
+            boxes[j] = group[j].bounds();
+            group_box.expand(boxes[j]);
+        }
+        auto bound = [&]() {
+            float worst = 0.0f;
+            for (size_t j = 0; j < count; ++j) {
+                if (best[j].size() < k) {
+                    return std::numeric_limits<float>::infinity();
+                }
+                worst = std::max(worst, best[j].top().first);
+            }
+            return worst;
+        };
+        auto offer = [&](const LeafEntry<KeyT, IndexT>& candidate) {
+            Rectangle box = candidate.bounds();
+            for (size_t j = 0; j < count; ++j) {
+                if (candidate.data_index == group[j].data_index) {
+                    continue;
+                }
+                float distance = boxes[j].minDistanceSquared(box);
+                if (best[j].size() < k) {
+                    best[j].emplace(distance, candidate.data_index);
+                } else if (distance < best[j].top().first) {
+                    best[j].pop();
+                    best[j].emplace(distance, candidate.data_index);
+                }
+            }
+        };
+
+        for (const auto& entry : ingest_buffer) {
+            offer(entry);
+        }
+        std::priority_queue<Neighbour, std::vector<Neighbour>, std::greater<Neighbour>> queue;
+        queue.emplace(0.0f, root_index);
+        while (!queue.empty()) {
+            Neighbour top = queue.top();
+            queue.pop();
+            if (top.first > bound()) {
+                break;
+            }
+            const NodeType& node = nodes[top.second];
+            if (node.is_leaf) {
+                for (const auto& entry : node.leaves()) {
+                    offer(entry);
+                }
+                continue;
+            }
+            float limit = bound();
+            for (const auto& entry : node.branches()) {
+                float distance = group_box.minDistanceSquared(entry.bounding_box);
+                if (distance <= limit) {
+                    queue.emplace(distance, entry.child_index);
+                }
+            }
+        }
+
+        for (size_t j = 0; j < count; ++j) {
+            std::vector<Neighbour>& list = lists[group[j].data_index];
+            list.resize(best[j].size());
+            for (size_t i = list.size(); i-- > 0;) {
+                list[i] = best[j].top();
+                best[j].pop();
+            }
+        }
+    }
+
+    // Payload indices of the leaf records whose boxes meet `rect` (closed).
+    void collectIntersecting(IndexT node_index, const Rectangle& rect, std::vector<IndexT>& out) const {
+        const NodeType& node = nodes[node_index];
+        if (node.is_leaf) {
+            for (const auto& entry : node.leaves()) {
+                if (entry.bounds().intersects(rect)) {
+                    out.push_back(entry.data_index);
+                }
+            }
+            return;
+        }
+        for (const auto& entry : node.branches()) {
+            if (entry.bounding_box.intersects(rect)) {
+                collectIntersecting(entry.child_index, rect, out);
+            }
+        }
+    }
+
+    std::vector<IndexT> free_payloads;
+    size_t entry_count = 0;
+    std::vector<LeafEntry<KeyT, IndexT>> ingest_buffer;
+    size_t ingest_capacity = 0;
+    mutable TreeCounters tree_stats;
+};
+
+// Point-only datasets: leaves hold bare (x, y) keys instead of boxes.
+template <typename DataT>
+using PointRTree = RTree<DataT, Point>;
+
+// An RTree that can be repacked without taking it offline. startRebuild()
+// copies the entries, then a worker thread bulk-loads a fresh tree from
+// that snapshot. Reads and writes keep going to the live tree meanwhile,
+// and writes are also logged. When the new tree is ready the log is
+// replayed onto it and it replaces the live tree under the write lock.
+template <typename DataT, typename KeyT = Rectangle, typename IndexT = uint32_t>
+class RebuildableRTree {
+public:
+    using TreeType = RTree<DataT, KeyT, IndexT>;
+
+    RebuildableRTree() : tree(std::make_unique<TreeType>()) {}
+
+    ~RebuildableRTree() {
+        waitForRebuild();
+    }
+
+    void insert(const KeyT& key, const DataT& data) {
+        std::unique_lock<std::shared_mutex> lock(tree_mutex);
+        tree->insert(key, data);
+        if (rebuilding) {
+            delta.push_back({true, key, data});
+        }
+    }
+
+    bool remove(const KeyT& key, const DataT& data) {
+        std::unique_lock<std::shared_mutex> lock(tree_mutex);
+        bool removed = tree->remove(key, data);
+        if (removed && rebuilding) {
+            delta.push_back({false, key, data});
+        }
+        return removed;
+    }
+
+    std::vector<DataT> rangeQuery(const Rectangle& rect) const {
+        std::shared_lock<std::shared_mutex> lock(tree_mutex);
+        return tree->rangeQuery(rect);
+    }
+
+    std::vector<DataT> nearest(const Point& point, size_t k) const {
+        std::shared_lock<std::shared_mutex> lock(tree_mutex);
+        return tree->nearest(point, k);
+    }
+
+    TreeReport analyze() const {
+        std::shared_lock<std::shared_mutex> lock(tree_mutex);
+        return tree->analyze();
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(tree_mutex);
+        return tree->size();
+    }
+
+    // Starts a background rebuild; returns false if one is already running.
+    bool startRebuild() {
+        std::lock_guard<std::mutex> worker_lock(worker_mutex);
+        std::vector<std::pair<KeyT, DataT>> snapshot;
+        {
+            // Shared is enough to freeze the tree, since every writer takes
+            // the lock exclusively, and lets queries run during the copy.
+            // Readers never touch `rebuilding` or `delta`, and worker_mutex
+            // keeps other startRebuild() calls out.
+            std::shared_lock<std::shared_mutex> lock(tree_mutex);
+            if (rebuilding) {
+                return false;
+            }
+            snapshot = tree->items();
+            delta.clear();
+            rebuilding = true;
+        }
+        // The previous worker cleared `rebuilding` as its last locked step,
+        // so joining it here cannot wait on tree_mutex.
+        if (worker.joinable()) {
+            worker.join();
+        }
+        worker = std::thread([this, snapshot = std::move(snapshot)]() {
+            auto fresh = std::make_unique<TreeType>();
+            fresh->bulkLoad(snapshot);
+
+            std::unique_lock<std::shared_mutex> lock(tree_mutex);
+            for (const auto& change : delta) {
+                if (change.is_insert) {
+                    fresh->insert(change.key, change.data);
+                } else {
+                    fresh->remove(change.key, change.data);
+                }
+            }
+            tree = std::move(fresh);
+            delta.clear();
+            rebuilding = false;
+            ++rebuild_count;
+        });
+        return true;
+    }
+
+    // Starts a rebuild if average node fill has dropped below `min_fill`
+    // (a fraction of MAX_ENTRIES).
+    bool rebuildIfDegraded(double min_fill) {
+        if (analyze().averageFill() >= min_fill) {
+            return false;
+        }
+        return startRebuild();
+    }
+
+    void waitForRebuild() {
+        std::lock_guard<std::mutex> worker_lock(worker_mutex);
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    size_t rebuilds() const {
+        std::shared_lock<std::shared_mutex> lock(tree_mutex);
+        return rebuild_count;
+    }
+
+private:
+    struct Change {
+        bool is_insert;
+        KeyT key;
+        DataT data;
+    };
+
+    std::unique_ptr<TreeType> tree;
+    mutable std::shared_mutex tree_mutex;
+    std::vector<Change> delta;
+    bool rebuilding = false;
+    size_t rebuild_count = 0;
+
+    std::mutex worker_mutex;
+    std::thread worker;
+};
+
+// Hit, miss and invalidation counts of a CachedRTree.
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;  // cached results dropped by a write
+    uint64_t evictions = 0;      // cached results dropped for space
+
+    double hitRate() const {
+        return hits + misses ? static_cast<double>(hits) / static_cast<double>(hits + misses) : 0.0;
+    }
+};
+
+// An RTree with an LRU cache of rangeQuery() results keyed by the query
+// rectangle, for workloads that repeat the same windows. The cached query
+// boxes are themselves kept in an RTree, so a write looks up and drops
+// exactly the cached results its key matches - the ones it changes - and
+// leaves the rest warm. Lookups reorder the LRU list, so unlike RTree the
+// cached queries are not const and need external locking to be shared.
+// Other queries go to tree(), uncached.
+template <typename DataT, typename KeyT = Rectangle, typename IndexT = uint32_t>
+class CachedRTree {
+public:
+    using TreeType = RTree<DataT, KeyT, IndexT>;
+
+    explicit CachedRTree(size_t capacity = 1024) : capacity(capacity) {}
+
+    void insert(const KeyT& key, const DataT& data) {
+        live.insert(key, data);
+        invalidate(key);
+    }
+
+    void insertBatch(const std::vector<std::pair<KeyT, DataT>>& batch) {
+        live.insertBatch(batch);
+        for (const auto& item : batch) {
+            invalidate(item.first);
+        }
+    }
+
+    bool remove(const KeyT& key, const DataT& data) {
+        bool removed = live.remove(key, data);
+        if (removed) {
+            invalidate(key);
+        }
+        return removed;
+    }
+
+    void bulkLoad(const std::vector<std::pair<KeyT, DataT>>& items,
+                  PackingOrder order = PackingOrder::SortTileRecursive) {
+        live.bulkLoad(items, order);
+        clearCache();
+    }
+
+    std::vector<DataT> rangeQuery(const Rectangle& rect) {
+        auto found = lookup.find(rect);
+        if (found != lookup.end()) {
+            Slot& slot = slots[found->second];
+            recency.splice(recency.begin(), recency, slot.position);
+            ++cache_stats.hits;
+            return slot.results;
+        }
+        ++cache_stats.misses;
+        std::vector<DataT> results = live.rangeQuery(rect);
+        if (capacity > 0) {
+            if (lookup.size() >= capacity) {
+                drop(recency.back());
+                ++cache_stats.evictions;
+            }
+            store(rect, results);
+        }
+        return results;
+    }
+
+    void clearCache() {
+        slots.clear();
+        free_slots.clear();
+        recency.clear();
+        lookup.clear();
+        cached_queries = RTree<uint32_t>();
+    }
+
+    const TreeType& tree() const {
+        return live;
+    }
+
+    size_t size() const {
+        return live.size();
+    }
+
+    size_t cachedQueries() const {
+        return lookup.size();
+    }
+
+    const CacheStats& stats() const {
+        return cache_stats;
+    }
+
+private:
+    struct Slot {
+        Rectangle query;
+        std::vector<DataT> results;
+        std::list<uint32_t>::iterator position;  // in `recency`
+    };
+
+    // Equal rectangles hash alike; the + 0.0f folds -0 into +0.
+    struct RectangleHash {
+        size_t operator()(const Rectangle& rect) const {
+            size_t seed = 0;
+            for (float value : {rect.x_min, rect.y_min, rect.x_max, rect.y_max}) {
+                seed ^= std::hash<float>()(value + 0.0f) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
+
+    void store(const Rectangle& rect, const std::vector<DataT>& results) {
+        uint32_t slot_index;
+        if (!free_slots.empty()) {
+            slot_index = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            slot_index = static_cast<uint32_t>(slots.size());
+            slots.emplace_back();
+        }
+        recency.push_front(slot_index);
+        slots[slot_index] = {rect, results, recency.begin()};
+        lookup.emplace(rect, slot_index);
+        cached_queries.insert(rect, slot_index);
+    }
+
+    void drop(uint32_t slot_index) {
+        Slot& slot = slots[slot_index];
+        cached_queries.remove(slot.query, slot_index);
+        lookup.erase(slot.query);
+        recency.erase(slot.position);
+        slot.results = std::vector<DataT>();
+        free_slots.push_back(slot_index);
+    }
+
+    // Drops the cached results `key` would appear in: the query boxes it
+    // matches under keyMatches(), found with the same test on the cache's
+    // own index (overlap for boxes, closed containment for points).
+    void invalidate(const Rectangle& key) {
+        dropAll(cached_queries.rangeQuery(key));
+    }
+
+    void invalidate(const Point& key) {
+        dropAll(cached_queries.stabQuery(key));
+    }
+
+    void dropAll(const std::vector<uint32_t>& slot_indices) {
+        for (uint32_t slot_index : slot_indices) {
+            drop(slot_index);
+        }
+        cache_stats.invalidations += slot_indices.size();
+    }
+
+    TreeType live;
+    size_t capacity;
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free_slots;
+    std::list<uint32_t> recency;  // slot indices, most recently used first
+    std::unordered_map<Rectangle, uint32_t, RectangleHash> lookup;
+    RTree<uint32_t> cached_queries;  // query box -> slot index
+    CacheStats cache_stats;
+};
+
+// An RTree shared by concurrent readers and writers, with a reader-writer
+// latch per node instead of one lock around the tree. The nodes, payloads,
+// subtree choice and quadratic split are the wrapped RTree's own; the
+// latches sit in a second NodeArena indexed like the node arena. Latches
+// are always taken top-down, so they cannot deadlock. Node slots freed by
+// remove() are reused, so one latch can be a parent's and later a child's;
+// lock-order checkers such as TSan's report that as a cycle, but at any one
+// time every latch is still taken above the ones below it.
+//   rangeQuery - keeps shared latches down the path it is exploring. Entries
+//                only move between nodes while their parent is latched
+//                exclusively, so a reader never misses or repeats one, and
+//                writers below or beside its path carry on.
+//   insert     - first crabs down with shared latches, taking only the leaf
+//                exclusively; this works when every box on the way already
+//                covers the key and the leaf has room. Otherwise it retries
+//                with exclusive crabbing from the root, widening boxes on
+//                the way down and releasing everything above a node that
+//                can take one more entry without splitting.
+//   remove     - waits for the operations in flight, blocks new ones and
+//                runs RTree::remove(), since condensing can reinsert
+//                entries anywhere in the tree.
+// Readers index the payload array and the arenas' chunk tables without a
+// lock, so those are reserved ahead and only grow while insert() holds
+// every other operation off the way remove() does. An exclusive insert
+// sets its nodes aside before it changes anything, so it never runs out
+// halfway through a split.
+template <typename DataT, typename KeyT = Rectangle, typename IndexT = uint32_t>
+class LatchedRTree {
+public:
+    using TreeType = RTree<DataT, KeyT, IndexT>;
+    using NodeType = typename TreeType::NodeType;
+
+    // `capacity` is a starting size for the payload array; the node budget
+    // starts at one node per entry. Both double when an insert runs short.
+    explicit LatchedRTree(size_t capacity = NodeArena<NodeType, IndexT>::CHUNK_SIZE)
+        : capacity(capacity), node_capacity(capacity + NodeArena<NodeType, IndexT>::CHUNK_SIZE) {
+        tree.payloads.reserve(capacity);
+        tree.nodes.reserve(node_capacity);
+        latches.reserve(node_capacity);
+        syncLatches();
+        root = tree.root_index;
+    }
+
+    void insert(const KeyT& key, const DataT& data) {
+        IndexT data_index = INVALID_INDEX<IndexT>;
+        while (true) {
+            {
+                std::shared_lock<std::shared_mutex> remove_lock(remove_mutex);
+                if (data_index == INVALID_INDEX<IndexT>) {
+                    data_index = storePayload(data);
+                }
+                if (data_index != INVALID_INDEX<IndexT>) {
+                    LeafEntry<KeyT, IndexT> entry(key, data_index);
+                    if (insertOptimistic(entry) || insertPessimistic(entry)) {
+                        return;
+                    }
+                }
+            }
+            grow();
+        }
+    }
+
+    bool remove(const KeyT& key, const DataT& data) {
+        std::unique_lock<std::shared_mutex> remove_lock(remove_mutex);
+        bool removed = tree.remove(key, data);
+        syncLatches();
+        root = tree.root_index;
+        levels = tree.height();
+        return removed;
+    }
+
+    std::vector<DataT> rangeQuery(const Rectangle& rect) const {
+        std::shared_lock<std::shared_mutex> remove_lock(remove_mutex);
+        std::vector<DataT> results;
+        IndexT root_index;
+        auto root_lock = lockRoot<std::shared_lock<std::shared_mutex>>(root_index);
+        rangeQueryHelper(root_index, rect, results);
+        return results;
+    }
+
+    // Counts inserts from the moment their payload is stored.
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> remove_lock(remove_mutex);
+        std::lock_guard<std::mutex> lock(allocation_mutex);
+        return tree.size();
+    }
+
+    // Inserts that had to take the exclusive path.
+    size_t pessimisticInserts() const {
+        return pessimistic_inserts.load();
+    }
+
+private:
+    struct Latch {
+        mutable std::shared_mutex mutex;
+
+        Latch() = default;
+        Latch(bool) {}
+
+        // Arena slots are assigned when handed out; a latch is never in use
+        // then, so there is nothing to copy.
+        Latch& operator=(const Latch&) {
+            return *this;
+        }
+    };
+
+    std::shared_mutex& latch(IndexT index) const {
+        return latches[index].mutex;
+    }
+
+    // Latches the current root. A root split publishes the new root while
+    // the old one is still latched exclusively, so a root that is still
+    // current once latched stays current until it is released.
+    template <typename Lock>
+    Lock lockRoot(IndexT& index) const {
+        while (true) {
+            index = root;
+            Lock lock(latch(index));
+            if (root == index) {
+                return lock;
+            }
+        }
+    }
+
+    // INVALID_INDEX when the payload array is full and has to grow first.
+    IndexT storePayload(const DataT& data) {
+        std::lock_guard<std::mutex> lock(allocation_mutex);
+        if (tree.payloads.size() >= capacity && tree.free_payloads.empty()) {
+            return INVALID_INDEX<IndexT>;
+        }
+        IndexT data_index = tree.storePayload(data);
+        ++tree.entry_count;
+        return data_index;
+    }
+
+    // Sets `count` nodes aside for one insert; false when that could move
+    // the chunk tables under readers.
+    bool reserveNodes(size_t count) {
+        std::lock_guard<std::mutex> lock(allocation_mutex);
+        if (tree.nodes.size() + reserved_nodes + count > node_capacity) {
+            return false;
+        }
+        reserved_nodes += count;
+        return true;
+    }
+
+    void releaseNodes(size_t count) {
+        std::lock_guard<std::mutex> lock(allocation_mutex);
+        reserved_nodes -= count;
+    }
+
+    // Allocates a reserved node and its latch. The node stays private to
+    // the caller until an entry for it is written under its parent's
+    // exclusive latch.
+    IndexT createNode(bool is_leaf) {
+        std::lock_guard<std::mutex> lock(allocation_mutex);
+        --reserved_nodes;
+        IndexT index = tree.createNode(is_leaf);
+        syncLatches();
+        return index;
+    }
+
+    // Waits for the operations in flight, as remove() does, and doubles
+    // whichever budget an insert found short.
+    void grow() {
+        std::unique_lock<std::shared_mutex> remove_lock(remove_mutex);
+        if (tree.payloads.size() >= capacity && tree.free_payloads.empty()) {
+            capacity = std::max<size_t>(2 * capacity, 1);
+            tree.payloads.reserve(capacity);
+        }
+        if (tree.nodes.size() + levels + 1 > node_capacity) {
+            node_capacity = std::max(2 * node_capacity, tree.nodes.size() + levels + 1);
+            tree.nodes.reserve(node_capacity);
+            latches.reserve(node_capacity);
+        }
+    }
+
+    void syncLatches() {
+        while (latches.size() < tree.nodes.size()) {
+            latches.allocate(true);
+        }
+    }
+
+    // chooseLeaf under shared latches: each child is latched before its
+    // parent is released, and only the leaf is latched exclusively. Gives
+    // up (false) where the exclusive path is needed.
+    bool insertOptimistic(const LeafEntry<KeyT, IndexT>& entry) {
+        Rectangle box = entry.bounds();
+        IndexT parent_index;
+        auto parent_lock = lockRoot<std::shared_lock<std::shared_mutex>>(parent_index);
+        if (tree.nodes[parent_index].is_leaf) {
+            return false;
+        }
+        while (true) {
+            const NodeType& parent = tree.nodes[parent_index];
+            const BranchEntry<IndexT>& branch = parent.entries[TreeType::chooseSubtree(parent, box)];
+            if (!branch.bounding_box.contains(box)) {
+                return false;
+            }
+            // is_leaf never changes while a node is reachable, so it can be
+            // read before the child is latched.
+            NodeType& child = tree.nodes[branch.child_index];
+            if (!child.is_leaf) {
+                std::shared_lock<std::shared_mutex> child_lock(latch(branch.child_index));
+                parent_lock.swap(child_lock);
+                parent_index = branch.child_index;
+                continue;
+            }
+            std::unique_lock<std::shared_mutex> leaf_lock(latch(branch.child_index));
+            parent_lock.unlock();
+            if (child.size() >= MAX_ENTRIES) {
+                return false;
+            }
+            child.push(entry);
+            return true;
+        }
+    }
+
+    // chooseLeaf under exclusive latches. Boxes are widened on the way
+    // down, so only splits travel back up, and only through the latched
+    // nodes that were full. Gives up (false) before changing anything if
+    // the node budget has to grow first.
+    bool insertPessimistic(const LeafEntry<KeyT, IndexT>& entry) {
+        using ExclusiveLatch = std::unique_lock<std::shared_mutex>;
+        Rectangle box = entry.bounds();
+        IndexT root_index;
+        std::vector<ExclusiveLatch> held;  // top to bottom, parallel to `path`
+        held.push_back(lockRoot<ExclusiveLatch>(root_index));
+        // Each level splits at most once and the root may gain a parent;
+        // the height is fixed while the root is latched.
+        size_t budget = levels + 1;
+        if (!reserveNodes(budget)) {
+            return false;
+        }
+        ++pessimistic_inserts;
+        std::vector<IndexT> path{root_index};
+        while (!tree.nodes[path.back()].is_leaf) {
+            NodeType& parent = tree.nodes[path.back()];
+            BranchEntry<IndexT>& branch = parent.entries[TreeType::chooseSubtree(parent, box)];
+            branch.bounding_box.expand(box);
+            IndexT child_index = branch.child_index;
+            ExclusiveLatch child_lock(latch(child_index));
+            if (tree.nodes[child_index].size() < MAX_ENTRIES) {
+                held.clear();
+                path.clear();
+            }
+            held.push_back(std::move(child_lock));
+            path.push_back(child_index);
+        }
+
+        // Every node below path[0] is full, and path[0] is only full when it
+        // is the root, so the splits and the new root are known up front.
+        size_t splits = 0;
+        while (splits < path.size() && tree.nodes[path[path.size() - 1 - splits]].size() >= MAX_ENTRIES) {
+            ++splits;
+        }
+        bool new_root = splits == path.size();
+        releaseNodes(budget - splits - (new_root ? 1 : 0));
+        std::vector<IndexT> spare;
+        for (size_t i = path.size(); i-- > path.size() - splits;) {
+            spare.push_back(createNode(tree.nodes[path[i]].is_leaf));
+        }
+        if (new_root) {
+            spare.push_back(createNode(false));
+        }
+
+        tree.nodes[path.back()].push(entry);
+        auto next_spare = spare.begin();
+        for (size_t i = path.size(); i-- > path.size() - splits;) {
+            BranchEntry<IndexT> sibling = tree.splitInto(path[i], *next_spare++);
+            BranchEntry<IndexT> split(tree.nodeMBR(path[i]), path[i]);
+            if (i > 0) {
+                NodeType& parent = tree.nodes[path[i - 1]];
+                for (auto& branch : parent.branches()) {
+                    if (branch.child_index == path[i]) {
+                        branch.bounding_box = split.bounding_box;
+                        break;
+                    }
+                }
+                parent.push(sibling);
+                continue;
+            }
+            // Only the root can split with nothing latched above it.
+            IndexT new_root_index = *next_spare++;
+            tree.nodes[new_root_index].push(split);
+            tree.nodes[new_root_index].push(sibling);
+            tree.root_index = new_root_index;
+            root = new_root_index;
+            ++levels;
+        }
+        return true;
+    }
+
+    // Latch coupling for readers: the node stays latched while its
+    // children are searched.
+    void rangeQueryHelper(IndexT node_index, const Rectangle& rect, std::vector<DataT>& results) const {
+        const NodeType& node = tree.nodes[node_index];
+        if (node.is_leaf) {
+            for (const auto& entry : node.leaves()) {
+                if (keyMatches(entry.key, rect)) {
+                    results.push_back(tree.payloads[entry.data_index]);
+                }
+            }
+            return;
+        }
+        for (const auto& entry : node.branches()) {
+            if (entry.bounding_box.intersects(rect)) {
+                std::shared_lock<std::shared_mutex> child_lock(latch(entry.child_index));
+                rangeQueryHelper(entry.child_index, rect, results);
+            }
+        }
+    }
+
+    TreeType tree;
+    NodeArena<Latch, IndexT> latches;
+    std::atomic<IndexT> root;
+    size_t levels = 1;  // changes only under the root's exclusive latch or in remove()
+    size_t capacity;
+    size_t node_capacity;
+    size_t reserved_nodes = 0;  // set aside by exclusive inserts in flight
+    mutable std::mutex allocation_mutex;
+    mutable std::shared_mutex remove_mutex;  // exclusive only in remove()
+    std::atomic<size_t> pessimistic_inserts{0};
+};
+
+// Spatial index split into independent RTrees ("shards") for multi-core
+// ingest. Each shard owns one HilbertPartitioner range of a fixed `domain`
+// rectangle. The ranges start equal; rebalance() recuts them at quantiles
+// of the stored keys. Every shard has its own lock, keeps the bounding box
+// of what it stores, and owns one long-lived worker thread that runs its
+// share of batch inserts and rebalances. Queries visit only the shards whose
+// box can match, and hold one shard lock at a time, so a query running
+// alongside writes sees each shard at a single moment but not all shards
+// at the same moment.
+template <typename DataT, typename KeyT = Rectangle, typename IndexT = uint32_t>
+class ShardedRTree {
+public:
+    using TreeType = RTree<DataT, KeyT, IndexT>;
+
+    ShardedRTree(size_t shard_count, const Rectangle& domain) : ranges(shard_count, domain) {
+        for (size_t i = 0; i < ranges.partitions(); ++i) {
+            shards.push_back(std::make_unique<Shard>());
+        }
+    }
+
+    void insert(const KeyT& key, const DataT& data) {
+        std::shared_lock<std::shared_mutex> layout_lock(layout_mutex);
+        Shard& shard = *shards[shardOf(key)];
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.add(key);
+        shard.tree.insert(key, data);
+    }
+
+    // Splits the batch by shard and hands each shard's part to that
+    // shard's worker, which inserts it with RTree::insertBatch(). Batches
+    // under INLINE_BATCH entries are inserted on the calling thread, where
+    // the hand-off would cost more than it saves.
+    void insertBatch(const std::vector<std::pair<KeyT, DataT>>& batch) {
+        std::shared_lock<std::shared_mutex> layout_lock(layout_mutex);
+        std::vector<std::vector<std::pair<KeyT, DataT>>> parts(shards.size());
+        for (const auto& item : batch) {
+            parts[shardOf(item.first)].push_back(item);
+        }
+        auto load = [&](size_t i) {
+            if (parts[i].empty()) {
+                return;
+            }
+            Shard& shard = *shards[i];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& item : parts[i]) {
+                shard.add(item.first);
+            }
+            shard.tree.insertBatch(parts[i]);
+        };
+        if (batch.size() < INLINE_BATCH) {
+            for (size_t i = 0; i < shards.size(); ++i) {
+                load(i);
+            }
+        } else {
+            onWorkers(load);
+        }
+    }
+
+    // A shard's box is not shrunk by removals; rebalance() recomputes it.
+    bool remove(const KeyT& key, const DataT& data) {
+        std::shared_lock<std::shared_mutex> layout_lock(layout_mutex);
+        Shard& shard = *shards[shardOf(key)];
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.tree.remove(key, data);
+    }
+
+    std::vector<DataT> rangeQuery(const Rectangle& rect) const {
+        std::shared_lock<std::shared_mutex> layout_lock(layout_mutex);
+        std::vector<DataT> results;
+        for (const auto& shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            if (shard->has_bounds && shard->bounds.intersects(rect)) {
+                std::vector<DataT> found = shard->tree.rangeQuery(rect);
+                results.insert(results.end(), found.begin(), found.end());
+            }
+        }
+        return results;
+    }
+
+    // The k entries nearest `point`, nearest first. Shards are searched in
+    // order of their box's distance from the point, each with a distance
+    // browser, and the search stops at the first shard whose box is farther
+    // than the current k-th entry.
+    std::vector<DataT> nearest(const Point& point, size_t k) const {
+        std::shared_lock<std::shared_mutex> layout_lock(layout_mutex);
+        std::vector<std::pair<float, size_t>> order;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            std::shared_lock<std::shared_mutex> lock(shards[i]->mutex);
+            if (shards[i]->has_bounds) {
+                order.emplace_back(std::sqrt(shards[i]->bounds.minDistanceSquared(point)), i);
+            }
+        }
+        std::sort(order.begin(), order.end());
+
+        std::vector<std::pair<float, DataT>> best;  // sorted by distance
+        for (const auto& candidate : order) {
+            if (k == 0 || (best.size() == k && candidate.first > best.back().first)) {
+                break;
+            }
+            std::shared_lock<std::shared_mutex> lock(shards[candidate.second]->mutex);
+            auto browser = shards[candidate.second]->tree.browse(point);
+            DataT data;
+            float distance;
+            while (browser.next(data, distance) && (best.size() < k || distance < best.back().first)) {
+                auto position = std::upper_bound(best.begin(), best.end(), distance,
+                                                 [](float d, const std::pair<float, DataT>& item) { return d < item.first; });
+                best.insert(position, {distance, data});
+                if (best.size() > k) {
+                    best.pop_back();
+                }
+            }
+        }
+
+        std::vector<DataT> results;
+        results.reserve(best.size());
+        for (const auto& item : best) {
+            results.push_back(item.second);
+        }
+        return results;
+    }
+
+    // Recuts the Hilbert ranges so every shard gets an equal share of the
+    // stored entries, then each shard's worker bulk-loads it from its new
+    // share. Blocks all reads and writes while it runs.
+    void rebalance() {
+        std::unique_lock<std::shared_mutex> layout_lock(layout_mutex);
+        std::vector<std::pair<uint64_t, std::pair<KeyT, DataT>>> keyed;
+        for (const auto& shard : shards) {
+            for (auto& item : shard->tree.items()) {
+                keyed.emplace_back(ranges.keyOf(boundsOf(item.first)), std::move(item));
+            }
+        }
+        if (keyed.empty()) {
+            return;
+        }
+        std::sort(keyed.begin(), keyed.end(),
+                  [](const auto& a, const auto& b) { return a.first < b.first; });
+        std::vector<uint64_t> keys;
+        keys.reserve(keyed.size());
+        for (const auto& item : keyed) {
+            keys.push_back(item.first);
+        }
+        ranges.recut(keys);
+
+        std::vector<std::vector<std::pair<KeyT, DataT>>> parts(shards.size());
+        for (auto& item : keyed) {
+            parts[ranges.partitionOfKey(item.first)].push_back(std::move(item.second));
+        }
+        onWorkers([&](size_t i) {
+            Shard& shard = *shards[i];
+            shard.has_bounds = false;
+            shard.tree.bulkLoad(parts[i]);
+            for (const auto& item : parts[i]) {
+                shard.add(item.first);
+            }
+        });
+        ++rebalance_count;
+    }
+
+    // Rebalances if the largest shard holds more than `max_skew` times the
+    // mean shard size.
+    bool rebalanceIfSkewed(double max_skew = 2.0) {
+        std::vector<size_t> sizes = shardSizes();
+        size_t total = 0, largest = 0;
+        for (size_t size : sizes) {
+            total += size;
+            largest = std::max(largest, size);
+        }
+        if (static_cast<double>(largest) * sizes.size() <= max_skew * static_cast<double>(total)) {
+            return false;
+        }
+        rebalance();
+        return true;
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (size_t size : shardSizes()) {
+            total += size;
+        }
+        return total;
+    }
+
+    size_t shardCount() const {
+        return shards.size();
+    }
+
+    std::vector<size_t> shardSizes() const {
+        std::shared_lock<std::shared_mutex> layout_lock(layout_mutex);
+        std::vector<size_t> sizes;
+        for (const auto& shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            sizes.push_back(shard->tree.size());
+        }
+        return sizes;
+    }
+
+    // Shards a rangeQuery() over `rect` would search.
+    size_t shardsOverlapping(const Rectangle& rect) const {
+        std::shared_lock<std::shared_mutex> layout_lock(layout_mutex);
+        size_t count = 0;
+        for (const auto& shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            count += shard->has_bounds && shard->bounds.intersects(rect);
+        }
+        return count;
+    }
+
+    size_t rebalances() const {
+        std::shared_lock<std::shared_mutex> layout_lock(layout_mutex);
+        return rebalance_count;
+    }
+
+private:
+    static constexpr size_t INLINE_BATCH = 256;
+
+    struct Shard {
+        TreeType tree;
+        Rectangle bounds;  // of every key added since the last rebalance
+        bool has_bounds = false;
+        mutable std::shared_mutex mutex;
+
+        // The worker runs submitted jobs in order until the shard is
+        // destroyed, finishing any still queued.
+        std::mutex jobs_mutex;
+        std::condition_variable jobs_ready;
+        std::deque<std::packaged_task<void()>> jobs;
+        bool stopping = false;
+        std::thread worker;
+
+        Shard() {
+            worker = std::thread([this]() { work(); });
+        }
+
+        ~Shard() {
+            {
+                std::lock_guard<std::mutex> lock(jobs_mutex);
+                stopping = true;
+            }
+            jobs_ready.notify_one();
+            worker.join();
+        }
+
+        void add(const KeyT& key) {
+            if (has_bounds) {
+                bounds.expand(boundsOf(key));
+            } else {
+                bounds = boundsOf(key);
+                has_bounds = true;
+            }
+        }
+
+        std::future<void> submit(std::function<void()> job) {
+            std::packaged_task<void()> task(std::move(job));
+            std::future<void> done = task.get_future();
+            {
+                std::lock_guard<std::mutex> lock(jobs_mutex);
+                jobs.push_back(std::move(task));
+            }
+            jobs_ready.notify_one();
+            return done;
+        }
+
+        void work() {
+            while (true) {
+                std::packaged_task<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(jobs_mutex);
+                    jobs_ready.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                    if (jobs.empty()) {
+                        return;
+                    }
+                    task = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+                task();
+            }
+        }
+    };
+
+    size_t shardOf(const KeyT& key) const {
+        return ranges.partitionOf(boundsOf(key));
+    }
+
+    // Runs fn(i) on shard i's worker for every shard and waits for all of
+    // them. Every job is waited for before any exception is rethrown, as
+    // the jobs refer to the caller's locals.
+    template <typename Fn>
+    void onWorkers(Fn fn) {
+        std::vector<std::future<void>> done;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            done.push_back(shards[i]->submit([&fn, i]() { fn(i); }));
+        }
+        for (auto& job : done) {
+            job.wait();
+        }
+        for (auto& job : done) {
+            job.get();
+        }
+    }
+
+    HilbertPartitioner ranges;
+    std::vector<std::unique_ptr<Shard>> shards;
+    mutable std::shared_mutex layout_mutex;  // exclusive only in rebalance()
+    size_t rebalance_count = 0;
+};
+
+// Requests a PartitionedRTree coordinator sends to a partition.
+enum class PartitionOp : uint8_t {
+    Insert,
+    InsertBatch,
+    Remove,
+    Range,
+    Nearest
+};
+
+// Flat byte encoding for partition messages. Values are copied bit for
+// bit, so both ends must share a build (same types, layout and byte
+// order).
+class MessageWriter {
+public:
+    template <typename T>
+    void put(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "message fields must be trivially copyable");
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    std::string bytes;
+};
+
+class MessageReader {
+public:
+    explicit MessageReader(const std::string& bytes) : bytes(bytes) {}
+
+    template <typename T>
+    T get() {
+        static_assert(std::is_trivially_copyable<T>::value, "message fields must be trivially copyable");
+        if (offset + sizeof(T) > bytes.size()) {
+            throw std::out_of_range("Truncated partition message");
+        }
+        T value;
+        std::memcpy(&value, bytes.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    // Reads a record count and checks that the rest of the message can
+    // hold that many records of `record_size` bytes, so a corrupt count
+    // is rejected before anything is allocated for it.
+    uint64_t getCount(size_t record_size) {
+        uint64_t count = get<uint64_t>();
+        if (count > (bytes.size() - offset) / record_size) {
+            throw std::out_of_range("Partition message count exceeds its length");
+        }
+        return count;
+    }
+
+private:
+    const std::string& bytes;
+    size_t offset = 0;
+};
+
+// One partition of a PartitionedRTree: an RTree behind a request handler.
+// In a deployment each server lives in its own process and handle() is
+// fed by the network; a shared_mutex lets queries from several
+// coordinator threads run together.
+template <typename DataT, typename KeyT = Rectangle>
+class PartitionServer {
+public:
+    std::string handle(const std::string& request) {
+        MessageReader in(request);
+        MessageWriter out;
+        switch (in.get<PartitionOp>()) {
+            case PartitionOp::Insert: {
+                KeyT key = in.get<KeyT>();
+                DataT data = in.get<DataT>();
+                std::unique_lock<std::shared_mutex> lock(tree_mutex);
+                tree.insert(key, data);
+                break;
+            }
+            case PartitionOp::InsertBatch: {
+                std::vector<std::pair<KeyT, DataT>> batch(in.getCount(sizeof(KeyT) + sizeof(DataT)));
+                for (auto& item : batch) {
+                    item.first = in.get<KeyT>();
+                    item.second = in.get<DataT>();
+                }
+                std::unique_lock<std::shared_mutex> lock(tree_mutex);
+                tree.insertBatch(batch);
+                break;
+            }
+            case PartitionOp::Remove: {
+                KeyT key = in.get<KeyT>();
+                DataT data = in.get<DataT>();
+                std::unique_lock<std::shared_mutex> lock(tree_mutex);
+                out.put(tree.remove(key, data));
+                break;
+            }
+            case PartitionOp::Range: {
+                Rectangle rect = in.get<Rectangle>();
+                std::shared_lock<std::shared_mutex> lock(tree_mutex);
+                std::vector<DataT> found = tree.rangeQuery(rect);
+                out.put<uint64_t>(found.size());
+                for (const auto& data : found) {
+                    out.put(data);
+                }
+                break;
+            }
+            case PartitionOp::Nearest: {  // replies with (distance, data) pairs, nearest first
+                Point point = in.get<Point>();
+                uint64_t k = in.get<uint64_t>();
+                std::vector<std::pair<float, DataT>> found;
+                std::shared_lock<std::shared_mutex> lock(tree_mutex);
+                auto browser = tree.browse(point);
+                DataT data;
+                float distance;
+                while (found.size() < k && browser.next(data, distance)) {
+                    found.emplace_back(distance, data);
+                }
+                out.put<uint64_t>(found.size());
+                for (const auto& item : found) {
+                    out.put(item.first);
+                    out.put(item.second);
+                }
+                break;
+            }
+            default:
+                throw std::invalid_argument("Unknown partition request");
+        }
+        return out.bytes;
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(tree_mutex);
+        return tree.size();
+    }
+
+private:
+    RTree<DataT, KeyT> tree;
+    mutable std::shared_mutex tree_mutex;
+};
+
+// How a PartitionedRTree coordinator reaches its partitions: call() sends
+// one encoded request to partition `partition` and blocks for the encoded
+// reply. Implementations must allow concurrent calls, because queries
+// scatter to several partitions at once.
+class PartitionTransport {
+public:
+    virtual ~PartitionTransport() = default;
+
+    virtual std::string call(size_t partition, const std::string& request) = 0;
+
+    virtual size_t partitions() const = 0;
+};
+
+// Stand-in transport that runs every partition in this process and
+// delivers requests by direct call. Requests still go through the byte
+// encoding, so the coordinator and servers are tested exactly as they
+// would run over a network. Counts messages and request/reply bytes.
+template <typename DataT, typename KeyT = Rectangle>
+class LoopbackTransport : public PartitionTransport {
+public:
+    explicit LoopbackTransport(size_t partitions) {
+        for (size_t i = 0; i < std::max<size_t>(partitions, 1); ++i) {
+            servers.push_back(std::make_unique<PartitionServer<DataT, KeyT>>());
+        }
+    }
+
+    std::string call(size_t partition, const std::string& request) override {
+        std::string reply = servers.at(partition)->handle(request);
+        ++message_count;
+        byte_count += request.size() + reply.size();
+        return reply;
+    }
+
+    size_t partitions() const override {
+        return servers.size();
+    }
+
+    const PartitionServer<DataT, KeyT>& server(size_t partition) const {
+        return *servers.at(partition);
+    }
+
+    uint64_t messages() const {
+        return message_count.load();
+    }
+
+    uint64_t bytes() const {
+        return byte_count.load();
+    }
+
+private:
+    std::vector<std::unique_ptr<PartitionServer<DataT, KeyT>>> servers;
+    std::atomic<uint64_t> message_count{0};
+    std::atomic<uint64_t> byte_count{0};
+};
+
+// Coordinator for an index spread over the partitions behind a
+// PartitionTransport. Entries are split by HilbertPartitioner range over
+// a fixed `domain`, and the coordinator keeps each partition's bounding
+// box so queries go only to partitions that can match:
+//   rangeQuery - scatters to partitions whose box overlaps the query, in
+//                parallel, and concatenates the replies.
+//   nearest    - asks the partition nearest the point first, then scatters
+//                to the others whose box is closer than its k-th hit and
+//                merges by distance; two round trips at most.
+// One coordinator per index, driven from one thread; partition ranges are
+// fixed once data is loaded.
+template <typename DataT, typename KeyT = Rectangle>
+class PartitionedRTree {
+public:
+    PartitionedRTree(PartitionTransport& transport, const Rectangle& domain)
+        : transport(transport), ranges(transport.partitions(), domain), partitions(transport.partitions()) {}
+
+    void insert(const KeyT& key, const DataT& data) {
+        MessageWriter request;
+        request.put(PartitionOp::Insert);
+        request.put(key);
+        request.put(data);
+        size_t partition = ranges.partitionOf(boundsOf(key));
+        transport.call(partition, request.bytes);
+        partitions[partition].add(boundsOf(key));
+        ++entry_count;
+    }
+
+    // One message per partition the batch touches, sent in parallel.
+    void insertBatch(const std::vector<std::pair<KeyT, DataT>>& batch) {
+        std::vector<std::vector<const std::pair<KeyT, DataT>*>> parts(partitions.size());
+        for (const auto& item : batch) {
+            parts[ranges.partitionOf(boundsOf(item.first))].push_back(&item);
+        }
+        std::vector<size_t> targets;
+        for (size_t i = 0; i < parts.size(); ++i) {
+            if (!parts[i].empty()) {
+                targets.push_back(i);
+            }
+        }
+        parallelFor(targets.size(), targets.size(), [&](size_t t) {
+            MessageWriter request;
+            request.put(PartitionOp::InsertBatch);
+            request.put<uint64_t>(parts[targets[t]].size());
+            for (const auto* item : parts[targets[t]]) {
+                request.put(item->first);
+                request.put(item->second);
+            }
+            transport.call(targets[t], request.bytes);
+        });
+        for (const auto& item : batch) {
+            partitions[ranges.partitionOf(boundsOf(item.first))].add(boundsOf(item.first));
+        }
+        entry_count += batch.size();
+    }
+
+    bool remove(const KeyT& key, const DataT& data) {
+        MessageWriter request;
+        request.put(PartitionOp::Remove);
+        request.put(key);
+        request.put(data);
+        std::string reply = transport.call(ranges.partitionOf(boundsOf(key)), request.bytes);
+        bool removed = MessageReader(reply).get<bool>();
+        entry_count -= removed;
+        return removed;
+    }
+
+    std::vector<DataT> rangeQuery(const Rectangle& rect) const {
+        std::vector<size_t> targets;
+        for (size_t i = 0; i < partitions.size(); ++i) {
+            if (partitions[i].has_bounds && partitions[i].bounds.intersects(rect)) {
+                targets.push_back(i);
+            }
+        }
+        MessageWriter request;
+        request.put(PartitionOp::Range);
+        request.put(rect);
+        std::vector<std::string> replies = scatter(targets, request.bytes);
+
+        std::vector<DataT> results;
+        for (const auto& reply : replies) {
+            MessageReader in(reply);
+            for (uint64_t n = in.get<uint64_t>(); n > 0; --n) {
+                results.push_back(in.get<DataT>());
+            }
+        }
+        return results;
+    }
+
+    // The k entries nearest `point`, nearest first.
+    std::vector<DataT> nearest(const Point& point, size_t k) const {
+        std::vector<std::pair<float, size_t>> order;  // box distance, partition
+        for (size_t i = 0; i < partitions.size(); ++i) {
+            if (partitions[i].has_bounds) {
+                order.emplace_back(std::sqrt(partitions[i].bounds.minDistanceSquared(point)), i);
+            }
+        }
+        std::sort(order.begin(), order.end());
+        if (k == 0 || order.empty()) {
+            return {};
+        }
+
+        MessageWriter request;
+        request.put(PartitionOp::Nearest);
+        request.put(point);
+        request.put<uint64_t>(k);
+        std::vector<std::pair<float, DataT>> best;
+        auto collect = [&](const std::string& reply) {
+            MessageReader in(reply);
+            for (uint64_t n = in.get<uint64_t>(); n > 0; --n) {
+                float distance = in.get<float>();
+                best.emplace_back(distance, in.get<DataT>());
+            }
+        };
+        collect(transport.call(order[0].second, request.bytes));
+
+        // Entries a partition returns are no closer than its box, so only
+        // partitions whose box beats the first one's k-th hit can improve
+        // on it.
+        float horizon = best.size() < k ? std::numeric_limits<float>::max() : best.back().first;
+        std::vector<size_t> targets;
+        for (size_t i = 1; i < order.size() && order[i].first <= horizon; ++i) {
+            targets.push_back(order[i].second);
+        }
+        for (const auto& reply : scatter(targets, request.bytes)) {
+            collect(reply);
+        }
+        std::stable_sort(best.begin(), best.end(),
+                         [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        std::vector<DataT> results;
+        for (size_t i = 0; i < std::min(k, best.size()); ++i) {
+            results.push_back(best[i].second);
+        }
+        return results;
+    }
+
+    size_t size() const {
+        return entry_count;
+    }
+
+    // Partitions a rangeQuery() over `rect` would contact.
+    size_t partitionsOverlapping(const Rectangle& rect) const {
+        size_t count = 0;
+        for (const auto& partition : partitions) {
+            count += partition.has_bounds && partition.bounds.intersects(rect);
+        }
+        return count;
+    }
+
+private:
+    struct PartitionInfo {
+        Rectangle bounds;  // of every key sent; not shrunk by removals
+        bool has_bounds = false;
+
+        void add(const Rectangle& box) {
+            if (has_bounds) {
+                bounds.expand(box);
+            } else {
+                bounds = box;
+                has_bounds = true;
+            }
+        }
+    };
+
+    // Sends `request` to every target at once; replies in target order.
+    std::vector<std::string> scatter(const std::vector<size_t>& targets, const std::string& request) const {
+        std::vector<std::string> replies(targets.size());
+        parallelFor(targets.size(), targets.size(),
+                    [&](size_t t) { replies[t] = transport.call(targets[t], request); });
+        return replies;
+    }
+
+    PartitionTransport& transport;
+    HilbertPartitioner ranges;
+    std::vector<PartitionInfo> partitions;
+    size_t entry_count = 0;
+};
+
+// Log-structured spatial index for append-heavy data: a small mutable
+// RTree memtable in front of immutable, bulk-packed runs. Writes go to the
+// memtable and reach the runs only through bulk packing. A remove() of an
+// entry already in a run writes a tombstone instead of touching the run.
+// Runs of similar size are merged by repacking (size-tiered compaction),
+// and queries fan out over the memtable and every run.
+template <typename DataT, typename KeyT = Rectangle>
+class LsmRTree {
+public:
+    // What every level stores: the entry, its write sequence, and whether
+    // it is a tombstone cancelling one older copy of the same (key, data).
+    struct Record {
+        KeyT key;
+        DataT data;
+        uint64_t sequence;
+        bool tombstone;
+
+        bool operator==(const Record& other) const {
+            return sequence == other.sequence && tombstone == other.tombstone &&
+                   key == other.key && data == other.data;
+        }
+    };
+    using TreeType = RTree<Record, KeyT>;
+
+    explicit LsmRTree(size_t memtable_capacity = 16384, size_t fanout = 4,
+                      PackingOrder packing = PackingOrder::Hilbert)
+        : memtable_capacity(std::max<size_t>(memtable_capacity, 1)),
+          fanout(std::max<size_t>(fanout, 2)), packing(packing) {}
+
+    void insert(const KeyT& key, const DataT& data) {
+        memtable.insert(key, Record{key, data, next_sequence++, false});
+        ++live_count;
+        if (memtable.size() >= memtable_capacity) {
+            flush();
+        }
+    }
+
+    // Removes the newest live copy of (key, data). Returns false if there
+    // is none.
+    bool remove(const KeyT& key, const DataT& data) {
+        const Record* newest = nullptr;
+        std::vector<Record> candidates = liveCopies(key);
+        for (const auto& record : candidates) {
+            if (record.key == key && record.data == data && (!newest || record.sequence > newest->sequence)) {
+                newest = &record;
+            }
+        }
+        if (!newest) {
+            return false;
+        }
+
+        --live_count;
+        if (!memtable.remove(key, *newest)) {
+            memtable.insert(key, Record{key, data, next_sequence++, true});
+            if (memtable.size() >= memtable_capacity) {
+                flush();
+            }
+        }
+        return true;
+    }
+
+    std::vector<DataT> rangeQuery(const Rectangle& rect) const {
+        std::vector<DataT> results;
+        for (const auto& record : liveRecords(rect)) {
+            results.push_back(record.data);
+        }
+        return results;
+    }
+
+    // The k live entries nearest `point`. Each level is asked for its
+    // `fetch` nearest records, doubling until at least k survive tombstone
+    // cancellation closer than the nearest record any level might be
+    // holding back.
+    std::vector<DataT> nearest(const Point& point, size_t k) const {
+        auto distance = [&](const Record& record) { return boundsOf(record.key).minDistanceSquared(point); };
+        for (size_t fetch = std::max<size_t>(k, 1);; fetch *= 2) {
+            std::vector<Record> records;
+            float horizon = std::numeric_limits<float>::max();
+            forEachLevel([&](const TreeType& level) {
+                std::vector<Record> found = level.nearest(point, fetch);
+                if (found.size() == fetch) {
+                    horizon = std::min(horizon, distance(found.back()));
+                }
+                records.insert(records.end(), found.begin(), found.end());
+            });
+            cancelTombstones(records, false);
+            std::sort(records.begin(), records.end(),
+                      [&](const Record& a, const Record& b) { return distance(a) < distance(b); });
+
+            size_t certain = 0;
+            while (certain < records.size() && distance(records[certain]) < horizon) {
+                ++certain;
+            }
+            if (certain >= k || horizon == std::numeric_limits<float>::max()) {
+                std::vector<DataT> results;
+                for (size_t i = 0; i < std::min(k, records.size()); ++i) {
+                    results.push_back(records[i].data);
+                }
+                return results;
+            }
+        }
+    }
+
+    // Turns the memtable into a new immutable run, then compacts.
+    void flush() {
+        if (memtable.size() == 0) {
+            return;
+        }
+        std::vector<Record> records;
+        for (const auto& item : memtable.items()) {
+            records.push_back(item.second);
+        }
+        memtable = TreeType();
+        addRun(records);
+        compactTiers();
+    }
+
+    // Flushes and merges every run into one, dropping all tombstones.
+    void compact() {
+        flush();
+        if (runs.size() > 1 || (runs.size() == 1 && runs[0].size() != live_count)) {
+            std::vector<size_t> all(runs.size());
+            for (size_t i = 0; i < all.size(); ++i) {
+                all[i] = i;
+            }
+            mergeRuns(all);
+        }
+    }
+
+    size_t size() const {
+        return live_count;
+    }
+
+    size_t runCount() const {
+        return runs.size();
+    }
+
+    // Records (including tombstones) held by each run, oldest first.
+    std::vector<size_t> runSizes() const {
+        std::vector<size_t> sizes;
+        for (const auto& run : runs) {
+            sizes.push_back(run.size());
+        }
+        return sizes;
+    }
+
+private:
+    template <typename F>
+    void forEachLevel(F f) const {
+        f(memtable);
+        for (const auto& run : runs) {
+            f(run);
+        }
+    }
+
+    std::vector<Record> liveRecords(const Rectangle& rect) const {
+        return collectLive([&](const TreeType& level) { return level.rangeQuery(rect); });
+    }
+
+    // Live records stored under exactly `key`. exactQuery() descends with
+    // closed containment, so zero-width and zero-height keys are found too.
+    std::vector<Record> liveCopies(const KeyT& key) const {
+        return collectLive([&](const TreeType& level) { return level.exactQuery(boundsOf(key)); });
+    }
+
+    template <typename Query>
+    std::vector<Record> collectLive(Query query) const {
+        std::vector<Record> records;
+        forEachLevel([&](const TreeType& level) {
+            std::vector<Record> found = query(level);
+            records.insert(records.end(), found.begin(), found.end());
+        });
+        cancelTombstones(records, false);
+        return records;
+    }
+
+    // Pairs each tombstone with the newest older live record of the same
+    // key and payload and drops both. Unmatched tombstones survive only if
+    // `keep_tombstones`, since they may still cancel something in a run
+    // that was not part of `records`.
+    static void cancelTombstones(std::vector<Record>& records, bool keep_tombstones) {
+        auto key_less = [](const Record& a, const Record& b) {
+            Rectangle ra = boundsOf(a.key), rb = boundsOf(b.key);
+            return std::tie(ra.x_min, ra.y_min, ra.x_max, ra.y_max) <
+                   std::tie(rb.x_min, rb.y_min, rb.x_max, rb.y_max);
+        };
+        std::sort(records.begin(), records.end(), key_less);
+
+        std::vector<bool> cancelled(records.size(), false);
+        for (size_t begin = 0, end = 0; begin < records.size(); begin = end) {
+            end = begin + 1;
+            while (end < records.size() && records[end].key == records[begin].key) {
+                ++end;
+            }
+            for (size_t t = begin; t < end; ++t) {
+                if (!records[t].tombstone) {
+                    continue;
+                }
+                size_t match = end;
+                for (size_t i = begin; i < end; ++i) {
+                    if (!records[i].tombstone && !cancelled[i] && records[i].data == records[t].data &&
+                        records[i].sequence < records[t].sequence &&
+                        (match == end || records[i].sequence > records[match].sequence)) {
+                        match = i;
+                    }
+                }
+                if (match != end) {
+                    cancelled[match] = true;
+                    cancelled[t] = true;
+                }
+            }
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (!cancelled[i] && (keep_tombstones || !records[i].tombstone)) {
+                records[kept++] = records[i];
+            }
+        }
+        records.resize(kept);
+    }
+
+    void addRun(const std::vector<Record>& records) {
+        if (records.empty()) {
+            return;
+        }
+        std::vector<std::pair<KeyT, Record>> items;
+        items.reserve(records.size());
+        for (const auto& record : records) {
+            items.emplace_back(record.key, record);
+        }
+        TreeType run;
+        run.bulkLoad(items, packing);
+        runs.push_back(std::move(run));
+    }
+
+    // Size-tiered compaction: whenever `fanout` runs are within a factor of
+    // two of each other in size, merge them into one.
+    void compactTiers() {
+        for (bool merged = true; merged;) {
+            merged = false;
+            for (size_t i = 0; i < runs.size() && !merged; ++i) {
+                std::vector<size_t> tier;
+                for (size_t j = 0; j < runs.size(); ++j) {
+                    if (runs[j].size() * 2 >= runs[i].size() && runs[j].size() <= runs[i].size() * 2) {
+                        tier.push_back(j);
+                    }
+                }
+                if (tier.size() >= fanout) {
+                    mergeRuns(tier);
+                    merged = true;
+                }
+            }
+        }
+    }
+
+    // Repacks the runs at `which` (ascending positions) into one run.
+    void mergeRuns(const std::vector<size_t>& which) {
+        std::vector<Record> records;
+        for (size_t index : which) {
+            for (const auto& item : runs[index].items()) {
+                records.push_back(item.second);
+            }
+        }
+        cancelTombstones(records, which.size() < runs.size());
+        for (size_t i = which.size(); i > 0; --i) {
+            runs.erase(runs.begin() + static_cast<ptrdiff_t>(which[i - 1]));
+        }
+        addRun(records);
+    }
+
+    TreeType memtable;
+    std::vector<TreeType> runs;  // oldest first
+    size_t memtable_capacity;
+    size_t fanout;
+    PackingOrder packing;
+    uint64_t next_sequence = 0;
+    size_t live_count = 0;
+};
+
+// A box moving with bounded velocity: each edge at time t is its position
+// at `reference_time` plus its velocity times the time elapsed. A moving
+// object's low and high edges share one velocity; a time-parameterized
+// bounding rectangle (TPBR) moves its low edges as slowly as its slowest
+// child's and its high edges as fast as its fastest child's, so it keeps
+// bounding them from its reference time on.
+struct MovingRectangle {
+    Rectangle box;  // extent at reference_time
+    float vx_min = 0, vy_min = 0, vx_max = 0, vy_max = 0;
+    float reference_time = 0;
+
+    MovingRectangle() = default;
+    MovingRectangle(const Rectangle& box, float vx, float vy, float reference_time = 0)
+        : box(box), vx_min(vx), vy_min(vy), vx_max(vx), vy_max(vy), reference_time(reference_time) {}
+
+    Rectangle at(float t) const {
+        float dt = t - reference_time;
+        return Rectangle(box.x_min + vx_min * dt, box.y_min + vy_min * dt,
+                         box.x_max + vx_max * dt, box.y_max + vy_max * dt);
+    }
+
+    // Integral of the area over [t1, t2]. Width and height are linear in t,
+    // so the integrand is a quadratic with a closed form.
+    double integratedArea(float t1, float t2) const {
+        Rectangle start = at(t1);
+        double w = start.x_max - start.x_min, h = start.y_max - start.y_min;
+        double dw = vx_max - vx_min, dh = vy_max - vy_min;
+        double span = t2 - t1;
+        return w * h * span + (w * dh + h * dw) * span * span / 2 + dw * dh * span * span * span / 3;
+    }
+
+    // Grows this TPBR to also bound `other` from time `t` on, and rebases
+    // it to `t`.
+    void expand(const MovingRectangle& other, float t) {
+        box = at(t);
+        box.expand(other.at(t));
+        vx_min = std::min(vx_min, other.vx_min);
+        vy_min = std::min(vy_min, other.vy_min);
+        vx_max = std::max(vx_max, other.vx_max);
+        vy_max = std::max(vy_max, other.vy_max);
+        reference_time = t;
+    }
+
+    // Whether the box meets `rect` (closed) at some moment of [t1, t2].
+    // Every edge condition is linear in t, so each one clips the window to
+    // a sub-interval and the box meets `rect` iff something is left.
+    bool intersects(const Rectangle& rect, float t1, float t2) const {
+        if (t1 == t2) {
+            return at(t1).intersects(rect);
+        }
+        float lo = t1, hi = t2;
+        // Keeps the part of [lo, hi] where edge + velocity * (t - ref) <= limit.
+        auto clip = [&](float edge, float velocity, float limit) {
+            if (velocity == 0) {
+                return edge <= limit;
+            }
+            float crossing = reference_time + (limit - edge) / velocity;
+            if (velocity > 0) {
+                hi = std::min(hi, crossing);
+            } else {
+                lo = std::max(lo, crossing);
+            }
+            return lo <= hi;
+        };
+        return clip(box.x_min, vx_min, rect.x_max) && clip(-box.x_max, -vx_max, -rect.x_min) &&
+               clip(box.y_min, vy_min, rect.y_max) && clip(-box.y_max, -vy_max, -rect.y_min);
+    }
+
+    bool operator==(const MovingRectangle& other) const {
+        return box == other.box && vx_min == other.vx_min && vy_min == other.vy_min &&
+               vx_max == other.vx_max && vy_max == other.vy_max && reference_time == other.reference_time;
+    }
+};
+
+// Time-parameterized R-tree (TPR-tree) for predictive queries over moving
+// objects. Entries are MovingRectangles and internal nodes hold TPBRs, so
+// boxes are functions of time rather than fixed rectangles. Insert and
+// split minimize area integrated over [now, now + horizon], the window the
+// tree is tuned to answer. Bounds are only guaranteed from the time they
+// were last tightened onward, so queries must not ask about times before
+// the latest update.
+template <typename DataT>
+class TprTree {
+public:
+    // A node's record: a child node (internal) or payload (leaf) index with
+    // its moving bounds.
+    struct Entry {
+        MovingRectangle bounds;
+        uint32_t index;
+    };
+
+    struct TprNode {
+        static constexpr size_t CAPACITY = MAX_ENTRIES + 1;
+
+        bool is_leaf;
+        uint16_t count;
+        Entry entries[CAPACITY];
+
+        TprNode() : is_leaf(true), count(0) {}
+        TprNode(bool is_leaf) : is_leaf(is_leaf), count(0) {}
+
+        void push(const Entry& entry) {
+            assert(count < CAPACITY);
+            entries[count++] = entry;
+        }
+
+        void erase(size_t i) {
+            assert(i < count);
+            entries[i] = entries[--count];
+        }
+    };
+
+    NodeArena<TprNode> nodes;
+    std::vector<DataT> payloads;
+    uint32_t root_index;
+
+    explicit TprTree(float horizon = 60.0f) : horizon(horizon) {
+        root_index = nodes.allocate(true);
+    }
+
+    void insert(const MovingRectangle& object, const DataT& data, float now) {
+        advance(now);
+        uint32_t payload_index;
+        if (!free_payloads.empty()) {
+            payload_index = free_payloads.back();
+            free_payloads.pop_back();
+            payloads[payload_index] = data;
+        } else {
+            payload_index = static_cast<uint32_t>(payloads.size());
+            payloads.push_back(data);
+        }
+        insertEntry(Entry{object, payload_index}, now);
+        ++entry_count;
+    }
+
+    // Removes the entry inserted as (object, data). Returns false if absent.
+    bool remove(const MovingRectangle& object, const DataT& data, float now) {
+        advance(now);
+        std::vector<uint32_t> path;
+        size_t slot = 0;
+        uint32_t leaf_index = findLeaf(root_index, object, data, now, path, slot);
+        if (leaf_index == INVALID_INDEX<uint32_t>) {
+            return false;
+        }
+        free_payloads.push_back(nodes[leaf_index].entries[slot].index);
+        nodes[leaf_index].erase(slot);
+        --entry_count;
+        condenseTree(leaf_index, path, now);
+        return true;
+    }
+
+    // A moving object's report of a new position or velocity.
+    bool update(const MovingRectangle& old_object, const MovingRectangle& new_object, const DataT& data, float now) {
+        if (!remove(old_object, data, now)) {
+            return false;
+        }
+        insert(new_object, data, now);
+        return true;
+    }
+
+    // Timeslice query: everything that will overlap `rect` at time t.
+    std::vector<DataT> rangeQuery(const Rectangle& rect, float t) const {
+        return windowQuery(rect, t, t);
+    }
+
+    // Window query: everything that overlaps `rect` at some moment of
+    // [t1, t2].
+    std::vector<DataT> windowQuery(const Rectangle& rect, float t1, float t2) const {
+        if (t1 < current_time || t2 < t1) {
+            throw std::invalid_argument("TprTree query window must start at or after the latest update");
+        }
+        std::vector<DataT> results;
+        windowQueryHelper(root_index, rect, t1, t2, results);
+        return results;
+    }
+
+    size_t size() const {
+        return entry_count;
+    }
+
+private:
+    void advance(float now) {
+        current_time = std::max(current_time, now);
+    }
+
+    MovingRectangle nodeBounds(uint32_t node_index, float now) const {
+        const TprNode& node = nodes[node_index];
+        MovingRectangle bounds = node.entries[0].bounds;
+        for (size_t i = 0; i < node.count; ++i) {
+            bounds.expand(node.entries[i].bounds, now);
+        }
+        return bounds;
+    }
+
+    // `rect` grown by a hair, so rounding in rebased TPBRs never prunes an
+    // entry sitting exactly on a node's edge.
+    static Rectangle withSlack(const Rectangle& rect) {
+        float slack = 1e-5f * (1.0f + std::max({std::fabs(rect.x_min), std::fabs(rect.y_min),
+                                                std::fabs(rect.x_max), std::fabs(rect.y_max)}));
+        return Rectangle(rect.x_min - slack, rect.y_min - slack, rect.x_max + slack, rect.y_max + slack);
+    }
+
+    // Descends to the child whose TPBR gains the least integrated area,
+    // recording the internal nodes passed in `path`.
+    uint32_t chooseLeaf(const Entry& entry, float now, std::vector<uint32_t>& path) {
+        uint32_t node_index = root_index;
+        while (!nodes[node_index].is_leaf) {
+            path.push_back(node_index);
+            TprNode& node = nodes[node_index];
+            size_t best_index = 0;
+            double min_increase = std::numeric_limits<double>::max();
+            for (size_t i = 0; i < node.count; ++i) {
+                MovingRectangle grown = node.entries[i].bounds;
+                grown.expand(entry.bounds, now);
+                double increase = grown.integratedArea(now, now + horizon) -
+                                  node.entries[i].bounds.integratedArea(now, now + horizon);
+                if (increase < min_increase) {
+                    min_increase = increase;
+                    best_index = i;
+                }
+            }
+            node.entries[best_index].bounds.expand(entry.bounds, now);
+            node_index = node.entries[best_index].index;
+        }
+        return node_index;
+    }
+
+    void insertEntry(const Entry& entry, float now) {
+        std::vector<uint32_t> path;
+        uint32_t leaf_index = chooseLeaf(entry, now, path);
+        nodes[leaf_index].push(entry);
+        uint32_t node_index = leaf_index;
+        while (nodes[node_index].count > MAX_ENTRIES) {
+            uint32_t sibling = splitNode(node_index, now);
+            if (node_index == root_index) {
+                root_index = nodes.allocate(false);
+                nodes[root_index].push(Entry{nodeBounds(node_index, now), node_index});
+                nodes[root_index].push(Entry{nodeBounds(sibling, now), sibling});
+                return;
+            }
+            uint32_t parent_index = path.back();
+            path.pop_back();
+            TprNode& parent = nodes[parent_index];
+            for (size_t i = 0; i < parent.count; ++i) {
+                if (parent.entries[i].index == node_index) {
+                    parent.entries[i].bounds = nodeBounds(node_index, now);
+                    break;
+                }
+            }
+            parent.push(Entry{nodeBounds(sibling, now), sibling});
+            node_index = parent_index;
+        }
+    }
+
+    // R*-style split on integrated area: the entries are sorted by each
+    // edge position at `now` and each edge velocity, and the cut (keeping
+    // both halves at MIN_ENTRIES or more) whose two TPBRs have the least
+    // total integrated area wins. Returns the new sibling.
+    uint32_t splitNode(uint32_t node_index, float now) {
+        TprNode& node = nodes[node_index];
+        std::vector<Entry> entries(node.entries, node.entries + node.count);
+        auto bound = [&](size_t first, size_t last) {
+            MovingRectangle bounds = entries[first].bounds;
+            for (size_t i = first; i < last; ++i) {
+                bounds.expand(entries[i].bounds, now);
+            }
+            return bounds;
+        };
+        using Key = std::function<float(const Entry&)>;
+        const Key keys[] = {
+            [now](const Entry& e) { return e.bounds.at(now).x_min; },
+            [now](const Entry& e) { return e.bounds.at(now).x_max; },
+            [now](const Entry& e) { return e.bounds.at(now).y_min; },
+            [now](const Entry& e) { return e.bounds.at(now).y_max; },
+            [](const Entry& e) { return e.bounds.vx_min; },
+            [](const Entry& e) { return e.bounds.vx_max; },
+            [](const Entry& e) { return e.bounds.vy_min; },
+            [](const Entry& e) { return e.bounds.vy_max; },
+        };
+
+        std::vector<Entry> best_order;
+        size_t best_cut = 0;
+        double best_cost = std::numeric_limits<double>::max();
+        for (const Key& key : keys) {
+            std::sort(entries.begin(), entries.end(),
+                      [&](const Entry& a, const Entry& b) { return key(a) < key(b); });
+            for (size_t cut = MIN_ENTRIES; cut + MIN_ENTRIES <= entries.size(); ++cut) {
+                double cost = bound(0, cut).integratedArea(now, now + horizon) +
+                              bound(cut, entries.size()).integratedArea(now, now + horizon);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_cut = cut;
+                    best_order = entries;
+                }
+            }
+        }
+
+        uint32_t sibling_index = nodes.allocate(node.is_leaf);
+        TprNode& sibling = nodes[sibling_index];
+        node.count = 0;
+        for (size_t i = 0; i < best_order.size(); ++i) {
+            (i < best_cut ? node : sibling).push(best_order[i]);
+        }
+        return sibling_index;
+    }
+
+    // Finds the leaf holding (object, data), following only TPBRs that
+    // meet the object at `now`.
+    uint32_t findLeaf(uint32_t node_index, const MovingRectangle& object, const DataT& data, float now,
+                      std::vector<uint32_t>& path, size_t& slot) const {
+        const TprNode& node = nodes[node_index];
+        if (node.is_leaf) {
+            for (size_t i = 0; i < node.count; ++i) {
+                if (node.entries[i].bounds == object && payloads[node.entries[i].index] == data) {
+                    slot = i;
+                    return node_index;
+                }
+            }
+            return INVALID_INDEX<uint32_t>;
+        }
+        Rectangle box = withSlack(object.at(now));
+        path.push_back(node_index);
+        for (size_t i = 0; i < node.count; ++i) {
+            if (node.entries[i].bounds.at(now).intersects(box)) {
+                uint32_t leaf_index = findLeaf(node.entries[i].index, object, data, now, path, slot);
+                if (leaf_index != INVALID_INDEX<uint32_t>) {
+                    return leaf_index;
+                }
+            }
+        }
+        path.pop_back();
+        return INVALID_INDEX<uint32_t>;
+    }
+
+    // As RTree::condenseTree: tightens TPBRs on the way up, detaches nodes
+    // below MIN_ENTRIES and reinserts their objects.
+    void condenseTree(uint32_t node_index, std::vector<uint32_t>& path, float now) {
+        std::vector<uint32_t> orphans;
+        while (node_index != root_index) {
+            uint32_t parent_index = path.back();
+            path.pop_back();
+            TprNode& parent = nodes[parent_index];
+            for (size_t i = 0; i < parent.count; ++i) {
+                if (parent.entries[i].index != node_index) {
+                    continue;
+                }
+                if (nodes[node_index].count < MIN_ENTRIES) {
+                    parent.erase(i);
+                    orphans.push_back(node_index);
+                } else {
+                    parent.entries[i].bounds = nodeBounds(node_index, now);
+                }
+                break;
+            }
+            node_index = parent_index;
+        }
+
+        while (!nodes[root_index].is_leaf && nodes[root_index].count == 1) {
+            uint32_t old_root = root_index;
+            root_index = nodes[old_root].entries[0].index;
+            nodes.release(old_root);
+        }
+        if (!nodes[root_index].is_leaf && nodes[root_index].count == 0) {
+            nodes[root_index] = TprNode(true);
+        }
+
+        std::vector<Entry> reinserts;
+        for (uint32_t orphan : orphans) {
+            releaseSubtree(orphan, reinserts);
+        }
+        for (const auto& entry : reinserts) {
+            insertEntry(entry, now);
+        }
+    }
+
+    void releaseSubtree(uint32_t node_index, std::vector<Entry>& leaf_entries) {
+        const TprNode& node = nodes[node_index];
+        for (size_t i = 0; i < node.count; ++i) {
+            if (node.is_leaf) {
+                leaf_entries.push_back(node.entries[i]);
+            } else {
+                releaseSubtree(node.entries[i].index, leaf_entries);
+            }
+        }
+        nodes.release(node_index);
+    }
+
+    void windowQueryHelper(uint32_t node_index, const Rectangle& rect, float t1, float t2,
+                           std::vector<DataT>& results) const {
+        const TprNode& node = nodes[node_index];
+        Rectangle probe = node.is_leaf ? rect : withSlack(rect);
+        for (size_t i = 0; i < node.count; ++i) {
+            const Entry& entry = node.entries[i];
+            if (!entry.bounds.intersects(probe, t1, t2)) {
+                continue;
+            }
+            if (node.is_leaf) {
+                results.push_back(payloads[entry.index]);
+            } else {
+                windowQueryHelper(entry.index, rect, t1, t2, results);
+            }
+        }
+    }
+
+    float horizon;
+    float current_time = -std::numeric_limits<float>::max();
+    std::vector<uint32_t> free_payloads;
+    size_t entry_count = 0;
+};
+
+// Half-open validity interval [start, end) of a versioned entry or node.
+struct Lifetime {
+    static constexpr float OPEN = std::numeric_limits<float>::infinity();
+
+    float start;
+    float end;
+
+    bool alive() const {
+        return end == OPEN;
+    }
+
+    bool covers(float t) const {
+        return start <= t && t < end;
+    }
+
+    bool operator==(const Lifetime& other) const {
+        return start == other.start && end == other.end;
+    }
+};
+
+// Leaf key of a MultiVersionRTree: a box and the time it was in the tree.
+struct VersionedKey {
+    Rectangle box;
+    Lifetime lifetime;
+
+    bool operator==(const VersionedKey& other) const {
+        return box == other.box && lifetime == other.lifetime;
+    }
+};
+
+inline Rectangle boundsOf(const VersionedKey& key) {
+    return key.box;
+}
+
+// Partially persistent R-tree (multi-version, MVR/MV3R style) answering
+// "what was here at time T" for any past T. Time only moves forward:
+// insert() starts an entry's lifetime and remove() ends it, but nothing is
+// ever physically deleted. A node that overflows, or whose live entries
+// drop below MIN_ENTRIES, is version-split: it is retired at the current
+// time and its live entries are copied into fresh nodes (key-split if
+// there are too many, merged with a sibling's if too few). Each node is
+// therefore live-dense for the period it was current, so a timeslice query
+// follows only the nodes alive at its time and never scans dead history.
+// Leaf entries are ordinary LeafEntry<VersionedKey>; a child's lifetime is
+// its node's, kept beside the arena so BranchEntry is unchanged.
+template <typename DataT>
+class MultiVersionRTree {
+public:
+    using NodeType = Node<VersionedKey, uint32_t>;
+
+    // Live entries per version-split copy. One below MAX_ENTRIES, so every
+    // fresh node can take at least one insert before splitting again.
+    static constexpr size_t STRONG_MAX = MAX_ENTRIES - 1;
+
+    NodeArena<NodeType> nodes;
+    std::vector<DataT> payloads;
+
+    MultiVersionRTree() {
+        roots.emplace_back(-Lifetime::OPEN, createNode(true, -Lifetime::OPEN));
+    }
+
+    void insert(const Rectangle& key, const DataT& data, float now) {
+        advance(now);
+        payloads.push_back(data);
+        LeafEntry<VersionedKey, uint32_t> entry(VersionedKey{key, {now, Lifetime::OPEN}},
+                                                static_cast<uint32_t>(payloads.size() - 1));
+        std::vector<uint32_t> path;
+        uint32_t leaf_index = chooseLeaf(key, path);
+        addEntries(leaf_index, path, std::vector<LeafEntry<VersionedKey, uint32_t>>{entry}, now);
+        ++live_count;
+    }
+
+    // Ends the lifetime of the live entry (key, data) at `now`. Returns
+    // false if there is none.
+    bool remove(const Rectangle& key, const DataT& data, float now) {
+        advance(now);
+        std::vector<uint32_t> path;
+        size_t slot = 0;
+        uint32_t leaf_index = findLeaf(currentRoot(), key, data, path, slot);
+        if (leaf_index == INVALID_INDEX<uint32_t>) {
+            return false;
+        }
+        nodes[leaf_index].leaf_entries[slot].key.lifetime.end = now;
+        --live_count;
+        if (!path.empty() && liveCount(leaf_index) < MIN_ENTRIES) {
+            addEntries(leaf_index, path, std::vector<LeafEntry<VersionedKey, uint32_t>>{}, now);
+        }
+        return true;
+    }
+
+    // Timeslice query: the entries overlapping `rect` that were live at t.
+    std::vector<DataT> rangeQuery(const Rectangle& rect, float t) const {
+        std::vector<DataT> results;
+        auto root = std::upper_bound(roots.begin(), roots.end(), t,
+                                     [](float time, const auto& entry) { return time < entry.first; });
+        if (root != roots.begin()) {
+            timesliceHelper(std::prev(root)->second, rect, t, results);
+        }
+        return results;
+    }
+
+    // Interval query: the entries overlapping `rect` that were live at some
+    // moment of [t1, t2). Version splits copy entries, so matches are
+    // deduplicated by payload.
+    std::vector<DataT> intervalQuery(const Rectangle& rect, float t1, float t2) const {
+        std::vector<uint32_t> found;
+        for (size_t i = 0; i < roots.size(); ++i) {
+            float root_end = i + 1 < roots.size() ? roots[i + 1].first : Lifetime::OPEN;
+            float lo = std::max(t1, roots[i].first), hi = std::min(t2, root_end);
+            if (lo < hi) {
+                intervalHelper(roots[i].second, rect, lo, hi, found);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+        std::vector<DataT> results;
+        results.reserve(found.size());
+        for (uint32_t index : found) {
+            results.push_back(payloads[index]);
+        }
+        return results;
+    }
+
+    // Entries live now.
+    size_t size() const {
+        return live_count;
+    }
+
+    // Roots the tree has had, one per height or root version change.
+    size_t rootCount() const {
+        return roots.size();
+    }
+
+private:
+    void advance(float now) {
+        if (now < current_time) {
+            throw std::invalid_argument("MultiVersionRTree updates must not go back in time");
+        }
+        current_time = now;
+    }
+
+    uint32_t currentRoot() const {
+        return roots.back().second;
+    }
+
+    uint32_t createNode(bool is_leaf, float now) {
+        uint32_t index = nodes.allocate(is_leaf);
+        if (index >= lifetimes.size()) {
+            lifetimes.resize(index + 1);
+        }
+        lifetimes[index] = Lifetime{now, Lifetime::OPEN};
+        return index;
+    }
+
+    bool isLive(const LeafEntry<VersionedKey, uint32_t>& entry) const {
+        return entry.key.lifetime.alive();
+    }
+
+    bool isLive(const BranchEntry<uint32_t>& entry) const {
+        return lifetimes[entry.child_index].alive();
+    }
+
+    size_t liveCount(uint32_t node_index) const {
+        const NodeType& node = nodes[node_index];
+        size_t live = 0;
+        for (size_t i = 0; i < node.size(); ++i) {
+            live += node.is_leaf ? isLive(node.leaf_entries[i]) : isLive(node.entries[i]);
+        }
+        return live;
+    }
+
+    template <typename EntryT>
+    std::vector<EntryT> liveEntries(uint32_t node_index) const {
+        const NodeType& node = nodes[node_index];
+        std::vector<EntryT> live;
+        if constexpr (std::is_same<EntryT, BranchEntry<uint32_t>>::value) {
+            for (const auto& entry : node.branches()) {
+                if (isLive(entry)) {
+                    live.push_back(entry);
+                }
+            }
+        } else {
+            for (const auto& entry : node.leaves()) {
+                if (isLive(entry)) {
+                    live.push_back(entry);
+                }
+            }
+        }
+        return live;
+    }
+
+    // Least-enlargement descent through the live children of the current
+    // root, growing their boxes on the way down.
+    uint32_t chooseLeaf(const Rectangle& rect, std::vector<uint32_t>& path) {
+        uint32_t node_index = currentRoot();
+        while (!nodes[node_index].is_leaf) {
+            path.push_back(node_index);
+            NodeType& node = nodes[node_index];
+            size_t best_index = node.size();
+            float min_area_increase = std::numeric_limits<float>::max();
+            for (size_t i = 0; i < node.size(); ++i) {
+                if (!isLive(node.entries[i])) {
+                    continue;
+                }
+                Rectangle expanded_rect = node.entries[i].bounding_box;
+                expanded_rect.expand(rect);
+                float area_increase = expanded_rect.area() - node.entries[i].bounding_box.area();
+                if (area_increase < min_area_increase) {
+                    min_area_increase = area_increase;
+                    best_index = i;
+                }
+            }
+            assert(best_index < node.size());
+            node.entries[best_index].bounding_box.expand(rect);
+            node_index = node.entries[best_index].child_index;
+        }
+        return node_index;
+    }
+
+    uint32_t findLeaf(uint32_t node_index, const Rectangle& key, const DataT& data,
+                      std::vector<uint32_t>& path, size_t& slot) const {
+        const NodeType& node = nodes[node_index];
+        if (node.is_leaf) {
+            for (size_t i = 0; i < node.size(); ++i) {
+                const auto& entry = node.leaf_entries[i];
+                if (isLive(entry) && entry.key.box == key && payloads[entry.data_index] == data) {
+                    slot = i;
+                    return node_index;
+                }
+            }
+            return INVALID_INDEX<uint32_t>;
+        }
+        path.push_back(node_index);
+        for (const auto& entry : node.branches()) {
+            if (isLive(entry) && entry.bounding_box.contains(key)) {
+                uint32_t leaf_index = findLeaf(entry.child_index, key, data, path, slot);
+                if (leaf_index != INVALID_INDEX<uint32_t>) {
+                    return leaf_index;
+                }
+            }
+        }
+        path.pop_back();
+        return INVALID_INDEX<uint32_t>;
+    }
+
+    // Adds `additions` to a current node whose ancestors are in `path`.
+    // If that would overflow it, or it is below MIN_ENTRIES live entries,
+    // the node is version-split instead and its replacements are added to
+    // the parent in turn.
+    template <typename EntryT>
+    void addEntries(uint32_t node_index, std::vector<uint32_t>& path, const std::vector<EntryT>& additions,
+                    float now) {
+        NodeType& node = nodes[node_index];
+        bool underfull = !path.empty() && liveCount(node_index) + additions.size() < MIN_ENTRIES;
+        if (node.size() + additions.size() <= MAX_ENTRIES && !underfull) {
+            for (const auto& entry : additions) {
+                node.push(entry);
+            }
+            if (path.empty() && !node.is_leaf) {
+                shrinkRoot(node_index, now);
+            }
+            return;
+        }
+
+        std::vector<EntryT> live = liveEntries<EntryT>(node_index);
+        live.insert(live.end(), additions.begin(), additions.end());
+        lifetimes[node_index].end = now;
+        if (live.size() < MIN_ENTRIES && !path.empty()) {
+            // Weak version underflow: merge with the live sibling whose box
+            // grows least to take this node's box.
+            const NodeType& parent = nodes[path.back()];
+            Rectangle box = nodeMBR(node_index);
+            size_t best_index = parent.size();
+            float min_area_increase = std::numeric_limits<float>::max();
+            for (size_t i = 0; i < parent.size(); ++i) {
+                if (!isLive(parent.entries[i])) {
+                    continue;
+                }
+                Rectangle expanded_rect = parent.entries[i].bounding_box;
+                expanded_rect.expand(box);
+                float area_increase = expanded_rect.area() - parent.entries[i].bounding_box.area();
+                if (area_increase < min_area_increase) {
+                    min_area_increase = area_increase;
+                    best_index = i;
+                }
+            }
+            if (best_index < parent.size()) {
+                uint32_t sibling_index = parent.entries[best_index].child_index;
+                std::vector<EntryT> merged = liveEntries<EntryT>(sibling_index);
+                live.insert(live.end(), merged.begin(), merged.end());
+                lifetimes[sibling_index].end = now;
+            }
+        }
+
+        std::vector<BranchEntry<uint32_t>> replacements = keySplit(live, node.is_leaf, now);
+        if (path.empty()) {
+            while (replacements.size() > 1) {
+                replacements = keySplit(replacements, false, now);
+            }
+            uint32_t root_index = replacements.empty() ? createNode(true, now) : replacements[0].child_index;
+            roots.emplace_back(now, root_index);
+            return;
+        }
+        uint32_t parent_index = path.back();
+        path.pop_back();
+        addEntries(parent_index, path, replacements, now);
+    }
+
+    // A root left with no live children is replaced by an empty leaf, and
+    // one left with a single live child by that child, so the current root
+    // always has a live path down to a leaf.
+    void shrinkRoot(uint32_t root_index, float now) {
+        std::vector<BranchEntry<uint32_t>> live = liveEntries<BranchEntry<uint32_t>>(root_index);
+        if (live.size() > 1) {
+            return;
+        }
+        lifetimes[root_index].end = now;
+        roots.emplace_back(now, live.empty() ? createNode(true, now) : live[0].child_index);
+    }
+
+    // Spreads `entries` over fresh nodes of at most STRONG_MAX, cut evenly
+    // along the longer axis of their extent.
+    template <typename EntryT>
+    std::vector<BranchEntry<uint32_t>> keySplit(std::vector<EntryT> entries, bool is_leaf, float now) {
+        std::vector<BranchEntry<uint32_t>> created;
+        if (entries.empty()) {
+            return created;
+        }
+        Rectangle extent = entries[0].bounds();
+        for (const auto& entry : entries) {
+            extent.expand(entry.bounds());
+        }
+        bool by_x = extent.x_max - extent.x_min >= extent.y_max - extent.y_min;
+        std::sort(entries.begin(), entries.end(), [by_x](const EntryT& a, const EntryT& b) {
+            Rectangle box_a = a.bounds(), box_b = b.bounds();
+            return by_x ? box_a.x_min + box_a.x_max < box_b.x_min + box_b.x_max
+                        : box_a.y_min + box_a.y_max < box_b.y_min + box_b.y_max;
+        });
+        size_t parts = (entries.size() + STRONG_MAX - 1) / STRONG_MAX;
+        size_t begin = 0;
+        for (size_t part = 0; part < parts; ++part) {
+            size_t end = begin + (entries.size() - begin) / (parts - part);
+            uint32_t node_index = createNode(is_leaf, now);
+            for (size_t i = begin; i < end; ++i) {
+                nodes[node_index].push(entries[i]);
+            }
+            created.emplace_back(nodeMBR(node_index), node_index);
+            begin = end;
+        }
+        return created;
+    }
+
+    Rectangle nodeMBR(uint32_t node_index) const {
+        const NodeType& node = nodes[node_index];
+        Rectangle mbr = node.is_leaf ? node.leaf_entries[0].bounds() : node.entries[0].bounds();
+        for (size_t i = 1; i < node.size(); ++i) {
+            mbr.expand(node.is_leaf ? node.leaf_entries[i].bounds() : node.entries[i].bounds());
+        }
+        return mbr;
+    }
+
+    void timesliceHelper(uint32_t node_index, const Rectangle& rect, float t, std::vector<DataT>& results) const {
+        const NodeType& node = nodes[node_index];
+        if (node.is_leaf) {
+            for (const auto& entry : node.leaves()) {
+                if (entry.key.lifetime.covers(t) && keyMatches(entry.key.box, rect)) {
+                    results.push_back(payloads[entry.data_index]);
+                }
+            }
+            return;
+        }
+        for (const auto& entry : node.branches()) {
+            if (lifetimes[entry.child_index].covers(t) && entry.bounding_box.intersects(rect)) {
+                timesliceHelper(entry.child_index, rect, t, results);
+            }
+        }
+    }
+
+    // Visits the nodes live during [lo, hi), narrowing the window to each
+    // node's lifetime: a copy left behind in a retired node only counts for
+    // the time that node was current.
+    void intervalHelper(uint32_t node_index, const Rectangle& rect, float lo, float hi,
+                        std::vector<uint32_t>& found) const {
+        const NodeType& node = nodes[node_index];
+        if (node.is_leaf) {
+            for (const auto& entry : node.leaves()) {
+                const Lifetime& lifetime = entry.key.lifetime;
+                if (lifetime.start < hi && lo < lifetime.end && keyMatches(entry.key.box, rect)) {
+                    found.push_back(entry.data_index);
+                }
+            }
+            return;
+        }
+        for (const auto& entry : node.branches()) {
+            const Lifetime& lifetime = lifetimes[entry.child_index];
+            float child_lo = std::max(lo, lifetime.start), child_hi = std::min(hi, lifetime.end);
+            if (child_lo < child_hi && entry.bounding_box.intersects(rect)) {
+                intervalHelper(entry.child_index, rect, child_lo, child_hi, found);
+            }
+        }
+    }
+
+    std::vector<Lifetime> lifetimes;                // by node index
+    std::vector<std::pair<float, uint32_t>> roots;  // (became root at, node)
+    float current_time = -Lifetime::OPEN;
+    size_t live_count = 0;
+};
+
+void runTests() {
+    RTree<int> rtree;
+
+    // Test 1: Basic insertion
+    Rectangle rect1(0, 0, 5, 5);
+    rtree.insert(rect1, 1);
+    auto results = rtree.rangeQuery(Rectangle(0, 0, 10, 10));
+    assert(results.size() == 1 && results[0] == 1);
+    std::cout << "Test 1 passed!" << std::endl;
+
+    // Test 2: Overlapping rectangles
+    Rectangle rect2(6, 6, 10, 10);
+    rtree.insert(rect2, 2);
+    results = rtree.rangeQuery(Rectangle(0, 0, 10, 10));
+    assert(results.size() == 2);
+    std::cout << "Test 2 passed!" << std::endl;
+
+    // Test 3: Non-overlapping query
+    results = rtree.rangeQuery(Rectangle(15, 15, 20, 20));
+    assert(results.empty());
+    std::cout << "Test 3 passed!" << std::endl;
+
+    // Test 4: Splitting nodes
+    Rectangle rect3(11, 11, 15, 15);
+    Rectangle rect4(16, 16, 20, 20);
+    rtree.insert(rect3, 3);
+    rtree.insert(rect4, 4);
+    results = rtree.rangeQuery(Rectangle(10, 10, 20, 20));    
+    assert(results.size() == 2 && std::find(results.begin(), results.end(), 3) != results.end());
+    std::cout << "Test 4 passed!" << std::endl;
+
+    // Test 5: Point leaves
+    PointRTree<int> ptree;
+    for (int i = 0; i < 20; ++i) {
+        ptree.insert(Point(static_cast<float>(i), static_cast<float>(i)), i);
+    }
+    results = ptree.rangeQuery(Rectangle(5, 5, 9, 9));
+    std::sort(results.begin(), results.end());
+    assert((results == std::vector<int>{5, 6, 7, 8, 9}));
+    assert(ptree.rangeQuery(Rectangle(2.5f, 0, 2.7f, 20)).empty());
+    std::cout << "Test 5 passed!" << std::endl;
+
+    // Test 6: Payloads live outside the nodes
+    RTree<std::string> stree;
+    for (int i = 0; i < 12; ++i) {
+        float f = static_cast<float>(i);
+        stree.insert(Rectangle(f, f, f + 0.5f, f + 0.5f), "item" + std::to_string(i));
+    }
+    assert(stree.payloads.size() == 12 && stree.payloads[7] == "item7");
+    auto names = stree.rangeQuery(Rectangle(7, 7, 7.25f, 7.25f));
+    assert(names.size() == 1 && names[0] == "item7");
+    assert(sizeof(LeafEntry<Point>) == 3 * sizeof(float));
+    std::cout << "Test 6 passed!" << std::endl;
+
+    // Test 7: Configurable index width
+    assert(sizeof(BranchEntry<uint32_t>) == 5 * sizeof(uint32_t));
+    RTree<int, Rectangle, uint64_t> wide_tree;
+    for (int i = 0; i < 10; ++i) {
+        float f = static_cast<float>(i);
+        wide_tree.insert(Rectangle(f, 0, f + 1, 1), i);
+    }
+    assert(wide_tree.rangeQuery(Rectangle(0, 0, 10, 1)).size() == 10);
+    std::cout << "Test 7 passed!" << std::endl;
+
+    // Test 8: Arena keeps node addresses stable while the tree grows
+    RTree<int> arena_tree;
+    const Node<>* first_node = &arena_tree.nodes[0];
+    for (int i = 0; i < 5000; ++i) {
+        float f = static_cast<float>(i % 100);
+        float g = static_cast<float>(i / 100);
+        arena_tree.insert(Rectangle(f, g, f + 0.5f, g + 0.5f), i);
+    }
+    assert(arena_tree.nodes.size() > NodeArena<Node<>>::CHUNK_SIZE);
+    assert(&arena_tree.nodes[0] == first_node);
+    assert(arena_tree.rangeQuery(Rectangle(0, 0, 100, 100)).size() == 5000);
+    results = arena_tree.rangeQuery(Rectangle(10, 20, 10.25f, 20.25f));
+    assert(results.size() == 1 && results[0] == 2010);
+    RTree<int> copied_tree = arena_tree;
+    assert(copied_tree.rangeQuery(Rectangle(0, 0, 100, 100)).size() == 5000);
+    std::cout << "Test 8 passed!" << std::endl;
+
+    // Test 9: Relayout keeps query results and puts the root first
+    std::vector<int> before = arena_tree.rangeQuery(Rectangle(12, 12, 30, 17));
+    std::sort(before.begin(), before.end());
+    size_t node_count = arena_tree.nodes.size();
+    size_t levels = arena_tree.height();
+    for (NodeLayout layout : {NodeLayout::BreadthFirst, NodeLayout::VanEmdeBoas}) {
+        arena_tree.relayout(layout);
+        assert(arena_tree.root_index == 0 && arena_tree.nodes.size() == node_count);
+        assert(arena_tree.height() == levels);
+        std::vector<int> after = arena_tree.rangeQuery(Rectangle(12, 12, 30, 17));
+        std::sort(after.begin(), after.end());
+        assert(after == before);
+    }
+    arena_tree.insert(Rectangle(500, 500, 501, 501), -1);
+    assert(arena_tree.rangeQuery(Rectangle(499, 499, 502, 502)) == std::vector<int>{-1});
+    std::cout << "Test 9 passed!" << std::endl;
+
+    // Test 10: Bulk loading
+    std::vector<std::pair<Rectangle, int>> grid;
+    for (int i = 0; i < 1000; ++i) {
+        float x = static_cast<float>(i % 40), y = static_cast<float>(i / 40);
+        grid.emplace_back(Rectangle(x, y, x + 0.5f, y + 0.5f), i);
+    }
+    RTree<int> packed;
+    packed.bulkLoad(grid);
+    assert(packed.size() == 1000);
+    assert(packed.rangeQuery(Rectangle(0, 0, 40, 25)).size() == 1000);
+    results = packed.rangeQuery(Rectangle(3.1f, 2.1f, 5.2f, 3.2f));
+    std::sort(results.begin(), results.end());
+    assert((results == std::vector<int>{83, 84, 85, 123, 124, 125}));
+    assert(packed.height() <= 6);
+    std::cout << "Test 10 passed!" << std::endl;
+
+    // Test 11: Removal
+    for (int i = 0; i < 1000; i += 2) {
+        assert(packed.remove(grid[i].first, grid[i].second));
+    }
+    assert(!packed.remove(grid[0].first, grid[0].second));
+    assert(!packed.remove(grid[1].first, -1));
+    assert(packed.size() == 500);
+    results = packed.rangeQuery(Rectangle(0, 0, 40, 25));
+    assert(results.size() == 500);
+    assert(std::all_of(results.begin(), results.end(), [](int v) { return v % 2 == 1; }));
+    packed.insert(grid[0].first, grid[0].second);
+    assert(packed.payloads.size() == 1000);
+    for (int i = 0; i < 1000; i += 2) {
+        packed.remove(grid[i].first, grid[i].second);
+        packed.remove(grid[i + 1].first, grid[i + 1].second);
+    }
+    assert(packed.size() == 0 && packed.rangeQuery(Rectangle(0, 0, 40, 25)).empty());
+    assert(packed.nodes[packed.root_index].is_leaf);
+    std::cout << "Test 11 passed!" << std::endl;
+
+    // Test 12: Nearest neighbours
+    PointRTree<int> knn_tree;
+    for (int i = 0; i < 400; ++i) {
+        knn_tree.insert(Point(static_cast<float>(i % 20), static_cast<float>(i / 20)), i);
+    }
+    results = knn_tree.nearest(Point(10.2f, 4.1f), 1);
+    assert(results.size() == 1 && results[0] == 90);
+    results = knn_tree.nearest(Point(10.2f, 4.1f), 3);
+    assert((results == std::vector<int>{90, 91, 110}));
+    assert(knn_tree.nearest(Point(0, 0), 1000).size() == 400);
+    std::cout << "Test 12 passed!" << std::endl;
+
+    // Test 13: Instrumentation counters (only populated with -DRTREE_STATS)
+    RTree<int> counted;
+    for (int i = 0; i < 100; ++i) {
+        float f = static_cast<float>(i);
+        counted.insert(Rectangle(f, f, f + 0.5f, f + 0.5f), i);
+    }
+    QueryStats query_stats;
+    results = counted.rangeQuery(Rectangle(10, 10, 12.25f, 12.25f), query_stats);
+    assert(results.size() == 3);
+    if constexpr (STATS_ENABLED) {
+        assert(query_stats.leaf_results == 3);
+        assert(query_stats.nodes_per_level.size() == counted.height());
+        assert(query_stats.nodes_per_level[0] == 1);
+        assert(query_stats.overlap_hits + 1 == query_stats.nodesVisited());
+        assert(counted.stats().queries == 1 && counted.stats().splits > 0);
+        counted.resetStats();
+        assert(counted.stats().queries == 0);
+        parallelFor(400, 4, [&](size_t i) {  // concurrent const queries share the counters
+            float corner = static_cast<float>(i % 40);
+            counted.rangeQuery(Rectangle(corner, corner, corner + 2, corner + 2));
+        });
+        assert(counted.stats().queries == 400 && counted.stats().query_totals.nodes_per_level[0] == 400);
+        counted.resetStats();
+    } else {
+        assert(query_stats.nodesVisited() == 0 && counted.stats().splits == 0);
+    }
+    std::cout << "Test 13 passed!" << std::endl;
+
+    // Test 14: Health report
+    TreeReport report = counted.analyze();
+    assert(report.height == counted.height() && report.entries == 100);
+    assert(report.levels.front().nodes == 1 && report.levels.back().entries == 100);
+    size_t reported_nodes = 0;
+    for (const auto& level : report.levels) {
+        size_t histogram_nodes = 0;
+        for (size_t count : level.fill_histogram) {
+            histogram_nodes += count;
+        }
+        assert(histogram_nodes == level.nodes);
+        assert(level.dead_space >= 0 && level.dead_space <= level.total_area);
+        reported_nodes += level.nodes;
+    }
+    assert(reported_nodes == report.nodes && report.levels.front().sibling_overlap == 0);
+    assert(report.averageFill() > 0 && report.averageFill() <= 1);
+    assert(std::abs(unionArea({Rectangle(0, 0, 2, 2), Rectangle(1, 1, 3, 3)}) - 7.0) < 1e-6);
+    assert(std::abs(unionArea({Rectangle(0, 0, 4, 4), Rectangle(1, 1, 2, 2), Rectangle(6, 0, 7, 1),
+                               Rectangle(3, 3, 6, 3)}) - 17.0) < 1e-6);
+    std::vector<Rectangle> staggered;  // far more boxes than inclusion-exclusion could take
+    for (int i = 0; i < 100; ++i) {
+        staggered.emplace_back(i * 0.5f, 0, i * 0.5f + 1, 1);
+    }
+    assert(std::abs(unionArea(staggered) - 50.5) < 1e-6);
+    std::cout << "Test 14 passed!" << std::endl;
+
+    // Test 15: Background rebuild with concurrent writes
+    RebuildableRTree<int> live;
+    for (int i = 0; i < 2000; ++i) {
+        float f = static_cast<float>(i);
+        live.insert(Rectangle(f, 0, f + 0.5f, 1), i);
+    }
+    double fill_before = live.analyze().averageFill();
+    assert(live.startRebuild());
+    for (int i = 2000; i < 2100; ++i) {
+        float f = static_cast<float>(i);
+        live.insert(Rectangle(f, 0, f + 0.5f, 1), i);
+    }
+    for (int i = 0; i < 50; ++i) {
+        float f = static_cast<float>(i);
+        assert(live.remove(Rectangle(f, 0, f + 0.5f, 1), i));
+    }
+    live.waitForRebuild();
+    assert(live.rebuilds() == 1 && live.size() == 2050);
+    results = live.rangeQuery(Rectangle(0, 0, 2100, 1));
+    std::sort(results.begin(), results.end());
+    assert(results.size() == 2050 && results.front() == 50 && results.back() == 2099);
+    assert(live.analyze().averageFill() > fill_before);
+    assert(!live.rebuildIfDegraded(0.0));
+    std::cout << "Test 15 passed!" << std::endl;
+
+    // Test 16: Buffered ingest
+    RTree<int> ingest_tree;
+    ingest_tree.beginIngest(64);
+    for (int i = 0; i < 1000; ++i) {
+        float x = static_cast<float>(i % 50), y = static_cast<float>(i / 50);
+        ingest_tree.insert(Rectangle(x, y, x + 0.5f, y + 0.5f), i);
+        if (i == 30) {
+            assert(ingest_tree.rangeQuery(Rectangle(0, 0, 50, 20)).size() == 31);
+            assert(ingest_tree.nearest(Point(30.1f, 0.1f), 1) == std::vector<int>{30});
+        }
+    }
+    assert(ingest_tree.remove(Rectangle(49, 19, 49.5f, 19.5f), 999));
+    assert(ingest_tree.size() == 999 && ingest_tree.rangeQuery(Rectangle(0, 0, 50, 20)).size() == 999);
+    ingest_tree.endIngest();
+    assert(ingest_tree.rangeQuery(Rectangle(0, 0, 50, 20)).size() == 999);
+    results = ingest_tree.rangeQuery(Rectangle(10.1f, 3.1f, 10.2f, 3.2f));
+    assert(results.size() == 1 && results[0] == 160);
+    assert(ingest_tree.analyze().levels.back().entries == 999);
+    std::vector<uint64_t> corner{hilbertIndex(0, 0), hilbertIndex(0, 1), hilbertIndex(1, 1), hilbertIndex(1, 0)};
+    std::sort(corner.begin(), corner.end());
+    assert((corner == std::vector<uint64_t>{0, 1, 2, 3}));
+    assert(hilbertIndex(65535, 0) == (uint64_t(1) << 32) - 1);
+    std::cout << "Test 16 passed!" << std::endl;
+
+    // Test 17: Log-structured merge of packed runs
+    LsmRTree<int> lsm(16, 2);
+    for (int i = 0; i < 300; ++i) {
+        float x = static_cast<float>(i % 20), y = static_cast<float>(i / 20);
+        lsm.insert(Rectangle(x, y, x + 0.5f, y + 0.5f), i);
+    }
+    assert(lsm.runCount() > 0 && lsm.runCount() < 300 / 16);
+    for (int i = 0; i < 300; i += 3) {
+        float x = static_cast<float>(i % 20), y = static_cast<float>(i / 20);
+        assert(lsm.remove(Rectangle(x, y, x + 0.5f, y + 0.5f), i));
+    }
+    assert(!lsm.remove(Rectangle(0, 0, 0.5f, 0.5f), 0));
+    lsm.insert(Rectangle(0, 0, 0.5f, 0.5f), 0);
+    assert(lsm.size() == 201);
+    results = lsm.rangeQuery(Rectangle(0, 0, 20, 15));
+    assert(results.size() == 201);
+    assert(std::count(results.begin(), results.end(), 3) == 0 && std::count(results.begin(), results.end(), 0) == 1);
+    assert((lsm.nearest(Point(2.9f, 0.1f), 2) == std::vector<int>{2, 23}));
+    lsm.compact();
+    assert(lsm.runCount() == 1 && lsm.runSizes()[0] == 201);
+    assert(lsm.rangeQuery(Rectangle(0, 0, 20, 15)).size() == 201);
+
+    LsmRTree<int> flat_lsm(2, 2);  // zero-area keys, removed from the memtable and from runs
+    flat_lsm.insert(Rectangle(5, 5, 5, 5), 1);
+    flat_lsm.insert(Rectangle(0, 3, 10, 3), 2);
+    flat_lsm.insert(Rectangle(7, 0, 7, 9), 3);
+    assert(flat_lsm.runCount() > 0);
+    assert(flat_lsm.remove(Rectangle(5, 5, 5, 5), 1) && flat_lsm.remove(Rectangle(0, 3, 10, 3), 2));
+    assert(!flat_lsm.remove(Rectangle(5, 5, 5, 5), 1));
+    assert(flat_lsm.remove(Rectangle(7, 0, 7, 9), 3) && flat_lsm.size() == 0);
+    std::cout << "Test 17 passed!" << std::endl;
+
+    // Test 18: Batched insert
+    RTree<int> batched;
+    batched.insert(Rectangle(0, 0, 1, 1), -1);
+    std::vector<std::pair<Rectangle, int>> batch;
+    for (int i = 0; i < 300; ++i) {
+        float x = static_cast<float>((i * 37) % 100), y = static_cast<float>((i * 53) % 100);
+        batch.emplace_back(Rectangle(x, y, x + 0.5f, y + 0.5f), i);
+    }
+    batched.insertBatch(batch);
+    assert(batched.size() == 301);
+    TreeReport batched_report = batched.analyze();
+    assert(batched_report.levels.back().entries == 301);  // every leaf at the same depth
+    for (const auto& level : batched_report.levels) {
+        assert(level.underfull == 0);
+    }
+    Rectangle batch_window(10, 10, 30, 30);
+    std::vector<int> batch_expected;
+    for (const auto& item : batch) {
+        if (item.first.overlaps(batch_window)) {
+            batch_expected.push_back(item.second);
+        }
+    }
+    std::vector<int> batch_found = batched.rangeQuery(batch_window);
+    std::sort(batch_found.begin(), batch_found.end());
+    assert(batch_found == batch_expected);
+    batched.insertBatch({{Rectangle(200, 200, 201, 201), 1000}});
+    assert(batched.rangeQuery(Rectangle(199, 199, 202, 202)) == std::vector<int>{1000});
+    assert(batched.remove(Rectangle(0, 0, 1, 1), -1));
+    assert(batched.size() == 301);
+    std::cout << "Test 18 passed!" << std::endl;
+
+    // Test 19: TPR-tree timeslice and window queries
+    TprTree<int> moving(10.0f);
+    moving.insert(MovingRectangle(Rectangle(0, 0, 1, 1), 1, 0), 1, 0);    // heading east
+    moving.insert(MovingRectangle(Rectangle(10, 0, 11, 1), -1, 0), 2, 0); // heading west
+    moving.insert(MovingRectangle(Rectangle(0, 10, 1, 11), 0, 0), 3, 0);  // parked
+    std::vector<int> meeting = moving.rangeQuery(Rectangle(4.5f, 0, 6.5f, 1), 5);
+    std::sort(meeting.begin(), meeting.end());
+    assert((meeting == std::vector<int>{1, 2}));
+    assert(moving.rangeQuery(Rectangle(4.5f, 0, 6.5f, 1), 0).empty());
+    assert(moving.windowQuery(Rectangle(20, 0, 21, 1), 0, 30) == std::vector<int>{1});
+
+    std::mt19937 motion_rng(5);
+    std::uniform_real_distribution<float> place(0.0f, 100.0f), speed(-2.0f, 2.0f);
+    std::vector<MovingRectangle> fleet;
+    for (int i = 0; i < 300; ++i) {
+        float x = place(motion_rng), y = place(motion_rng);
+        fleet.emplace_back(Rectangle(x, y, x + 1, y + 1), speed(motion_rng), speed(motion_rng), 0.0f);
+        moving.insert(fleet.back(), 100 + i, 0);
+    }
+    for (int i = 0; i < 300; i += 2) {
+        MovingRectangle turned(fleet[i].at(5), speed(motion_rng), speed(motion_rng), 5.0f);
+        assert(moving.update(fleet[i], turned, 100 + i, 5));
+        fleet[i] = turned;
+    }
+    assert(moving.size() == 303);
+    for (float t : {5.0f, 8.0f, 15.0f}) {
+        Rectangle area(30, 30, 60, 60);
+        std::vector<int> expected, found = moving.windowQuery(area, t, t + 2);
+        for (int i = 0; i < 300; ++i) {
+            if (fleet[i].intersects(area, t, t + 2)) {
+                expected.push_back(100 + i);
+            }
+        }
+        found.erase(std::remove_if(found.begin(), found.end(), [](int id) { return id < 100; }), found.end());
+        std::sort(found.begin(), found.end());
+        assert(found == expected);
+    }
+    bool rejected = false;
+    try {
+        moving.rangeQuery(Rectangle(0, 0, 1, 1), 1);
+    } catch (const std::invalid_argument&) {
+        rejected = true;
+    }
+    assert(rejected);
+    std::cout << "Test 19 passed!" << std::endl;
+
+    // Test 20: Multi-version timeslice and interval queries
+    MultiVersionRTree<int> history;
+    history.insert(Rectangle(0, 0, 1, 1), 1, 0);
+    history.insert(Rectangle(2, 2, 3, 3), 2, 1);
+    assert(history.remove(Rectangle(0, 0, 1, 1), 1, 5));
+    assert(!history.remove(Rectangle(0, 0, 1, 1), 1, 6));
+    Rectangle everywhere(-1, -1, 10, 10);
+    assert(history.rangeQuery(everywhere, 0) == std::vector<int>{1});
+    assert(history.rangeQuery(everywhere, 5) == std::vector<int>{2});
+    std::vector<int> lived = history.intervalQuery(everywhere, 4, 6);
+    std::sort(lived.begin(), lived.end());
+    assert((lived == std::vector<int>{1, 2}));
+    assert(history.intervalQuery(everywhere, 5, 6) == std::vector<int>{2});
+
+    // Churn with version splits; every past timeslice must match the log.
+    struct Version { Rectangle box; int id; float start, end; };
+    std::vector<Version> log;
+    std::mt19937 version_rng(8);
+    for (int step = 0; step < 2000; ++step) {
+        float now = static_cast<float>(10 + step / 4);
+        size_t live = 0;
+        for (const auto& version : log) {
+            live += version.end == Lifetime::OPEN;
+        }
+        if (live > 20 && version_rng() % 3 == 0) {
+            for (auto& version : log) {
+                if (version.end == Lifetime::OPEN && version_rng() % 4 == 0) {
+                    assert(history.remove(version.box, version.id, now));
+                    version.end = now;
+                    break;
+                }
+            }
+        } else {
+            float x = static_cast<float>(version_rng() % 100), y = static_cast<float>(version_rng() % 100);
+            log.push_back({Rectangle(x, y, x + 2, y + 2), 1000 + step, now, Lifetime::OPEN});
+            history.insert(log.back().box, log.back().id, now);
+        }
+    }
+    assert(history.rootCount() > 1);
+    for (float t : {12.0f, 100.0f, 300.0f, 509.0f}) {
+        Rectangle area(20, 20, 70, 70);
+        std::vector<int> expected, found = history.rangeQuery(area, t);
+        for (const auto& version : log) {
+            if (version.start <= t && t < version.end && version.box.overlaps(area)) {
+                expected.push_back(version.id);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        assert(found == expected);
+    }
+
+    MultiVersionRTree<int> drained;  // emptying a split tree leaves a usable root
+    for (int i = 0; i < 5; ++i) {
+        drained.insert(Rectangle(i * 2.0f, 0, i * 2.0f + 1, 1), i, 0);
+    }
+    for (int i = 0; i < 5; ++i) {
+        assert(drained.remove(Rectangle(i * 2.0f, 0, i * 2.0f + 1, 1), i, static_cast<float>(i + 1)));
+    }
+    assert(drained.size() == 0 && drained.rangeQuery(everywhere, 5).empty());
+    drained.insert(Rectangle(4, 4, 5, 5), 9, 6);
+    assert(drained.rangeQuery(everywhere, 6) == std::vector<int>{9});
+    assert(drained.rangeQuery(everywhere, 0).size() == 5);
+    std::cout << "Test 20 passed!" << std::endl;
+
+    // Test 21: Exact geometry refinement
+    std::vector<Geometry> shapes = {
+        Geometry::polygon({Point(0, 0), Point(10, 0), Point(0, 10)}),
+        Geometry::polyline({Point(20, 20), Point(30, 30)}),
+        Geometry::polygon({Point(40, 40), Point(45, 40), Point(45, 45), Point(40, 45)}),
+    };
+    RTree<int> parcels;
+    for (int i = 0; i < static_cast<int>(shapes.size()); ++i) {
+        parcels.insert(shapes[i].bounds(), i);
+    }
+    auto shape_of = [&](int id) -> const Geometry& { return shapes[id]; };
+    auto square = [](float x, float y, float side) {
+        return Geometry::polygon({Point(x, y), Point(x + side, y), Point(x + side, y + side), Point(x, y + side)});
+    };
+    RefineStats refine_stats;
+    assert(parcels.refinedQuery(square(8, 8, 1), GeometryPredicate::Intersects, shape_of, refine_stats).empty());
+    assert(refine_stats.candidates == 1 && refine_stats.falsePositiveRate() == 1.0);
+    assert(parcels.refinedQuery(square(1, 1, 1), GeometryPredicate::Intersects, shape_of, refine_stats) ==
+           std::vector<int>{0});
+    assert(parcels.refinedQuery(square(1, 1, 1), GeometryPredicate::Contains, shape_of, refine_stats) ==
+           std::vector<int>{0});
+    assert(parcels.refinedQuery(square(1, 1, 1), GeometryPredicate::Within, shape_of, refine_stats).empty());
+    std::vector<int> inside = parcels.refinedQuery(square(19, 19, 31), GeometryPredicate::Within, shape_of, refine_stats);
+    std::sort(inside.begin(), inside.end());
+    assert((inside == std::vector<int>{1, 2}));
+    Geometry sight_line = Geometry::polyline({Point(25, 0), Point(25, 50)});
+    assert(parcels.refinedQuery(sight_line, GeometryPredicate::Intersects, shape_of, refine_stats) ==
+           std::vector<int>{1});
+    assert(intersects(Geometry::polyline({Point(10, 0), Point(20, 0)}), shapes[0]));  // touching vertex
+    assert(!intersects(Geometry::polyline({Point(11, 0), Point(20, 0)}), shapes[0])); // collinear, apart
+    std::cout << "Test 21 passed!" << std::endl;
+
+    // Test 22: Within, contains, stabbing and exact-match queries
+    RTree<int> windows;
+    std::vector<Rectangle> window_boxes;
+    for (int i = 0; i < 400; ++i) {
+        float x = static_cast<float>((i * 7) % 97), y = static_cast<float>((i * 13) % 89);
+        float w = static_cast<float>(1 + i % 5), h = static_cast<float>(1 + (i / 5) % 5);
+        window_boxes.emplace_back(x, y, x + w, y + h);
+        windows.insert(window_boxes.back(), i);
+    }
+    auto brute = [&](auto predicate) {
+        std::vector<int> ids;
+        for (int i = 0; i < static_cast<int>(window_boxes.size()); ++i) {
+            if (predicate(window_boxes[i])) {
+                ids.push_back(i);
+            }
+        }
+        return ids;
+    };
+    auto sorted = [](std::vector<int> ids) {
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+    Rectangle frame(20, 20, 50, 45);
+    assert(sorted(windows.withinQuery(frame)) == brute([&](const Rectangle& box) { return frame.contains(box); }));
+    Rectangle pin(30.5f, 30.5f, 31, 31);
+    assert(sorted(windows.containsQuery(pin)) == brute([&](const Rectangle& box) { return box.contains(pin); }));
+    Point probe(40.5f, 22.5f);
+    assert(sorted(windows.stabQuery(probe)) == brute([&](const Rectangle& box) { return box.contains(probe); }));
+    assert(windows.exactQuery(window_boxes[123]) ==
+           brute([&](const Rectangle& box) { return box == window_boxes[123]; }));
+    QueryStats stab_stats, overlap_stats;
+    windows.stabQuery(probe, stab_stats);
+    windows.rangeQuery(Rectangle(probe.x, probe.y, probe.x, probe.y), overlap_stats);
+    assert(stab_stats.nodesVisited() <= overlap_stats.nodesVisited());
+    std::cout << "Test 22 passed!" << std::endl;
+
+    // Test 23: Ray and segment queries
+    auto clip = [](const Ray& ray, const Rectangle& box) {  // Liang-Barsky reference
+        float lo = 0.0f, hi = ray.t_max;
+        float origin[2] = {ray.origin.x, ray.origin.y}, direction[2] = {ray.direction.x, ray.direction.y};
+        float low[2] = {box.x_min, box.y_min}, high[2] = {box.x_max, box.y_max};
+        for (int axis = 0; axis < 2; ++axis) {
+            if (direction[axis] == 0.0f) {
+                if (origin[axis] < low[axis] || origin[axis] > high[axis]) {
+                    return std::numeric_limits<float>::infinity();
+                }
+                continue;
+            }
+            float a = (low[axis] - origin[axis]) / direction[axis];
+            float b = (high[axis] - origin[axis]) / direction[axis];
+            lo = std::max(lo, std::min(a, b));
+            hi = std::min(hi, std::max(a, b));
+        }
+        return lo <= hi ? lo : std::numeric_limits<float>::infinity();
+    };
+    std::vector<Ray> rays = {Ray(Point(-5.0f, -3.3f), Point(1.0f, 0.61f)),
+                             Ray(Point(100.0f, 10.5f), Point(-1.0f, 0.0f)),        // horizontal
+                             Ray(Point(20.0f, -1.0f), Point(0.0f, 1.0f)),          // along box edges
+                             Ray(Point(33.3f, 41.7f), Point(0.0f, 0.0f)),          // degenerate: a stab
+                             Ray::segment(Point(3.1f, 80.2f), Point(70.4f, 5.9f)),
+                             Ray::segment(Point(45.5f, 45.5f), Point(46.5f, 44.5f))};
+    for (const Ray& ray : rays) {
+        std::vector<int> hits = windows.rayQuery(ray);
+        assert(sorted(hits) == brute([&](const Rectangle& box) { return clip(ray, box) < INFINITY; }));
+        for (size_t i = 1; i < hits.size(); ++i) {
+            assert(slabEntry(ray, window_boxes[hits[i - 1]]) <= slabEntry(ray, window_boxes[hits[i]]));
+        }
+        std::vector<int> first = windows.rayQuery(ray, 1);
+        assert(first.size() == std::min<size_t>(hits.size(), 1));
+        if (!first.empty()) {
+            assert(slabEntry(ray, window_boxes[first[0]]) == slabEntry(ray, window_boxes[hits[0]]));
+        }
+    }
+    assert(sorted(windows.rayQuery(rays[3])) == sorted(windows.stabQuery(rays[3].origin)));
+    assert(slabEntry(Ray(Point(0, 0), Point(1, 1)), Rectangle(2, 2, 3, 3)) == 2.0f);
+    assert(slabEntry(Ray(Point(0, 0), Point(1, 1)), Rectangle(3, 0, 4, 2)) == INFINITY);   // passes above it
+    assert(slabEntry(Ray::segment(Point(0, 0), Point(1, 0)), Rectangle(2, -1, 3, 1)) == INFINITY);  // too short
+    QueryStats first_stats, all_stats;
+    windows.rayQuery(rays[0], 1, first_stats);
+    windows.rayQuery(rays[0], std::numeric_limits<size_t>::max(), all_stats);
+    if constexpr (STATS_ENABLED) {
+        assert(first_stats.nodesVisited() < all_stats.nodesVisited());
+    }
+    std::cout << "Test 23 passed!" << std::endl;
+
+    // Test 24: Incremental distance browsing
+    Point origin_probe(41.3f, 37.9f);
+    auto browser = windows.browse(origin_probe);
+    std::vector<int> expected_order = windows.nearest(origin_probe, 25);
+    float previous = 0.0f;
+    for (size_t i = 0; i < expected_order.size(); ++i) {
+        int id;
+        float distance;
+        assert(browser.next(id, distance));
+        assert(distance >= previous);
+        assert(distance == std::sqrt(window_boxes[id].minDistanceSquared(origin_probe)));
+        assert(distance == std::sqrt(window_boxes[expected_order[i]].minDistanceSquared(origin_probe)));
+        previous = distance;
+    }
+    size_t browsed = expected_order.size();
+    for (int id; browser.next(id);) {
+        ++browsed;
+    }
+    assert(browsed == windows.size());
+
+    PointRTree<int> buffered_points;  // neighbours in the ingest buffer are browsed too
+    buffered_points.beginIngest(64);
+    for (int i = 0; i < 100; ++i) {
+        buffered_points.insert(Point(static_cast<float>(i), 0.0f), i);
+    }
+    auto walk = buffered_points.browse(Point(70.2f, 1.0f));
+    std::vector<int> walked;
+    for (int id; walked.size() < 4 && walk.next(id);) {
+        walked.push_back(id);
+    }
+    assert((walked == std::vector<int>{70, 71, 69, 72}));
+    std::cout << "Test 24 passed!" << std::endl;
+
+    // Test 25: Lazy range-query cursor
+    Rectangle page_window(10, 10, 60, 55);
+    auto pager = windows.rangeCursor(page_window);
+    auto pager_copy = windows.rangeCursor(page_window);
+    std::vector<int> paged, interleaved;
+    while (pager.fetch(paged, 7) == 7) {
+        int id;  // a second cursor advanced in between does not disturb the first
+        if (pager_copy.next(id)) {
+            interleaved.push_back(id);
+        }
+    }
+    assert(paged == windows.rangeQuery(page_window));
+    assert(std::equal(interleaved.begin(), interleaved.end(), paged.begin()));
+    int unused;
+    assert(!pager.next(unused) && pager.fetch(paged, 5) == 0);
+    assert(!windows.rangeCursor(Rectangle(500, 500, 600, 600)).next(unused));
+
+    auto buffered_cursor = buffered_points.rangeCursor(Rectangle(50, -1, 80, 1));
+    std::vector<int> buffered_hits;
+    buffered_cursor.fetch(buffered_hits, 1000);
+    assert(buffered_hits == buffered_points.rangeQuery(Rectangle(50, -1, 80, 1)));
+    assert(buffered_hits.size() == 31);
+    std::cout << "Test 25 passed!" << std::endl;
+
+    // Test 26: All-k-nearest and reverse-k-nearest neighbours
+    auto neighbour_distances = [&](int id, size_t k) {  // brute force: k smallest distances to others
+        std::vector<float> distances;
+        for (int other = 0; other < static_cast<int>(window_boxes.size()); ++other) {
+            if (other != id) {
+                distances.push_back(window_boxes[id].minDistanceSquared(window_boxes[other]));
+            }
+        }
+        std::sort(distances.begin(), distances.end());
+        distances.resize(std::min(k, distances.size()));
+        return distances;
+    };
+    auto all_knn = windows.allNearest(3, 4);
+    assert(all_knn.size() == windows.size());
+    std::vector<bool> seen_ids(window_boxes.size(), false);
+    for (const auto& [id, neighbours] : all_knn) {
+        seen_ids[id] = true;
+        std::vector<float> distances;
+        for (int neighbour : neighbours) {
+            assert(neighbour != id);
+            distances.push_back(window_boxes[id].minDistanceSquared(window_boxes[neighbour]));
+        }
+        assert(distances == neighbour_distances(id, 3));
+    }
+    assert(std::count(seen_ids.begin(), seen_ids.end(), true) == static_cast<long>(window_boxes.size()));
+
+    auto reverse_index = windows.reverseNearestIndex(3, 2);
+    std::vector<Point> sites = {Point(41.3f, 37.9f), Point(0.5f, 88.5f), Point(200, 200), Point(12, 60.25f)};
+    std::vector<std::vector<int>> reverse_hits = reverse_index.query(sites, 2);
+    for (size_t s = 0; s < sites.size(); ++s) {
+        std::vector<int> expected = brute([&](const Rectangle& box) {
+            int id = static_cast<int>(&box - window_boxes.data());
+            return box.minDistanceSquared(sites[s]) <= neighbour_distances(id, 3).back();
+        });
+        assert(sorted(reverse_hits[s]) == expected);
+        assert(sorted(reverse_index.query(sites[s])) == expected);
+    }
+    assert(!reverse_hits[0].empty() && reverse_hits[2].empty());
+
+    auto buffered_knn = buffered_points.allNearest(2, 1);  // records in the ingest buffer join in
+    assert(buffered_knn.size() == 100);
+    for (const auto& [id, neighbours] : buffered_knn) {
+        assert(neighbours.size() == 2 && std::abs(neighbours[0] - id) == 1 && std::abs(neighbours[1] - id) <= 2);
+    }
+    std::cout << "Test 26 passed!" << std::endl;
+
+    // Test 27: Selectivity estimation
+    auto estimator = windows.selectivityEstimator(16);
+    assert(estimator.cells() > 1 && estimator.cells() <= 16);
+    assert(std::abs(estimator.estimateCount(Rectangle(-10, -10, 200, 200)) - 400.0) < 0.01);  // everything
+    assert(estimator.estimateCount(Rectangle(300, 300, 400, 400)) == 0.0);
+    for (const Rectangle& region : {Rectangle(0, 0, 50, 45), Rectangle(20, 10, 90, 60)}) {
+        double actual = static_cast<double>(windows.rangeQuery(region).size());
+        assert(std::abs(estimator.estimateCount(region) - actual) < 0.25 * actual);
+    }
+    auto exact_estimator = windows.selectivityEstimator(100000);  // synopsis down to the leaves
+    auto point_estimator = buffered_points.selectivityEstimator();
+    assert(std::abs(point_estimator.estimateCount(Rectangle(-1, -1, 100, 1)) - 100.0) < 0.01);  // buffer too
+    assert(exact_estimator.cells() > estimator.cells());
+    std::cout << "Test 27 passed!" << std::endl;
+
+    // Test 28: Query result cache with spatial invalidation
+    CachedRTree<int> tiles(3);
+    for (int i = 0; i < 400; ++i) {
+        tiles.insert(window_boxes[i], i);
+    }
+    Rectangle tile_a(0, 0, 20, 20), tile_b(60, 60, 80, 80), tile_c(30, 0, 50, 20), tile_d(0, 60, 20, 80);
+    std::vector<int> tile_a_hits = tiles.rangeQuery(tile_a);
+    assert(tile_a_hits == windows.rangeQuery(tile_a));
+    tiles.rangeQuery(tile_b);
+    assert(tiles.rangeQuery(tile_a) == tile_a_hits);
+    assert(tiles.stats().hits == 1 && tiles.stats().misses == 2 && tiles.cachedQueries() == 2);
+
+    tiles.insert(Rectangle(5, 5, 6, 6), 1000);  // only tile_a changes
+    assert(tiles.stats().invalidations == 1 && tiles.cachedQueries() == 1);
+    tile_a_hits = tiles.rangeQuery(tile_a);
+    assert(std::count(tile_a_hits.begin(), tile_a_hits.end(), 1000) == 1);
+    tiles.rangeQuery(tile_b);
+    assert(tiles.stats().hits == 2);
+    assert(tiles.remove(Rectangle(5, 5, 6, 6), 1000));
+    assert(tiles.rangeQuery(tile_a) == windows.rangeQuery(tile_a));
+    tiles.insert(Rectangle(20, 20, 30, 30), 1001);  // touches tile_a's corner only: no match
+    assert(tiles.cachedQueries() == 2);
+
+    tiles.rangeQuery(tile_c);  // fills the cache; tile_d then evicts the least recent, tile_b
+    tiles.rangeQuery(tile_a);
+    tiles.rangeQuery(tile_d);
+    assert(tiles.stats().evictions == 1 && tiles.cachedQueries() == 3);
+    uint64_t hits_before = tiles.stats().hits;
+    tiles.rangeQuery(tile_a);
+    tiles.rangeQuery(tile_b);
+    assert(tiles.stats().hits == hits_before + 1);
+
+    CachedRTree<int, Point> point_tiles(8);  // a point on a tile edge is inside it
+    point_tiles.insert(Point(1, 1), 1);
+    assert(point_tiles.rangeQuery(Rectangle(0, 0, 10, 10)).size() == 1);
+    point_tiles.insert(Point(10, 5), 2);
+    assert(point_tiles.rangeQuery(Rectangle(0, 0, 10, 10)).size() == 2);
+
+    std::mt19937 cache_rng(5);  // random reads and writes agree with the uncached tree
+    std::uniform_int_distribution<int> cell(0, 9), action(0, 3);
+    CachedRTree<int> mirrored(16);
+    RTree<int> reference;
+    for (int step = 0; step < 3000; ++step) {
+        float x = static_cast<float>(cell(cache_rng) * 10), y = static_cast<float>(cell(cache_rng) * 10);
+        Rectangle tile(x, y, x + 10, y + 10);
+        if (action(cache_rng) == 0) {
+            Rectangle box(x + 2.5f, y + 7.5f, x + 12.5f, y + 8.5f);
+            mirrored.insert(box, step);
+            reference.insert(box, step);
+        } else {
+            assert(sorted(mirrored.rangeQuery(tile)) == sorted(reference.rangeQuery(tile)));
+        }
+    }
+    assert(mirrored.stats().hits > 0 && mirrored.stats().invalidations > 0);
+    std::cout << "Test 28 passed!" << std::endl;
+
+    // Test 29: Concurrent inserts and queries with per-node latches
+    constexpr int WRITERS = 3, READERS = 3, PER_WRITER = 1500, DOOMED = 300;
+    LatchedRTree<int> latched(64);  // grows while the readers run
+    auto latched_box = [](int id) {
+        float x = static_cast<float>((id * 37) % 500), y = static_cast<float>((id * 91) % 503);
+        return Rectangle(x, y, x + 2, y + 2);
+    };
+    for (int id = 100000; id < 100000 + DOOMED; ++id) {  // removed while the others run
+        latched.insert(latched_box(id), id);
+    }
+    std::atomic<int> published[WRITERS];
+    for (auto& count : published) {
+        count = 0;
+    }
+    std::atomic<bool> readers_ok{true};
+    std::vector<std::thread> latch_threads;
+    for (int w = 0; w < WRITERS; ++w) {
+        latch_threads.emplace_back([&, w]() {
+            for (int i = 0; i < PER_WRITER; ++i) {
+                int id = w * PER_WRITER + i;
+                latched.insert(latched_box(id), id);
+                published[w] = i + 1;
+            }
+        });
+    }
+    latch_threads.emplace_back([&]() {
+        for (int id = 100000; id < 100000 + DOOMED; ++id) {
+            if (!latched.remove(latched_box(id), id)) {
+                readers_ok = false;
+            }
+        }
+    });
+    for (int r = 0; r < READERS; ++r) {
+        latch_threads.emplace_back([&, r]() {
+            std::mt19937 reader_rng(r);
+            std::uniform_real_distribution<float> corner(0.0f, 450.0f);
+            for (int query = 0; query < 300; ++query) {
+                int seen[WRITERS];
+                for (int w = 0; w < WRITERS; ++w) {
+                    seen[w] = published[w];
+                }
+                float x = corner(reader_rng), y = corner(reader_rng);
+                Rectangle window(x, y, x + 60, y + 60);
+                std::vector<int> hits = latched.rangeQuery(window);
+                std::sort(hits.begin(), hits.end());
+                bool ok = std::adjacent_find(hits.begin(), hits.end()) == hits.end();
+                for (int w = 0; w < WRITERS && ok; ++w) {  // everything inserted before the query is found
+                    for (int i = 0; i < seen[w]; ++i) {
+                        int id = w * PER_WRITER + i;
+                        if (latched_box(id).overlaps(window) && !std::binary_search(hits.begin(), hits.end(), id)) {
+                            ok = false;
+                        }
+                    }
+                }
+                if (!ok) {
+                    readers_ok = false;
+                }
+            }
+        });
+    }
+    for (auto& thread : latch_threads) {
+        thread.join();
+    }
+    assert(readers_ok);
+    assert(latched.size() == WRITERS * PER_WRITER);
+    assert(latched.pessimisticInserts() < latched.size());
+    Rectangle latched_world(-1, -1, 1000, 1000), patch(100, 100, 180, 150);
+    assert(latched.rangeQuery(latched_world).size() == latched.size());
+    std::vector<int> patch_expected;
+    for (int id = 0; id < WRITERS * PER_WRITER; ++id) {
+        if (latched_box(id).overlaps(patch)) {
+            patch_expected.push_back(id);
+        }
+    }
+    assert(sorted(latched.rangeQuery(patch)) == patch_expected);
+
+    // Unit-width boxes in descending x with heights cycling 1-3 leave the
+    // quadratic split's nodes underfull: well over one node per entry.
+    constexpr int SKEWED = 20000;
+    LatchedRTree<int> skewed(SKEWED);
+    RTree<int> skewed_reference;
+    for (int i = 0; i < SKEWED; ++i) {
+        float x = static_cast<float>(SKEWED - i);
+        Rectangle box(x, 0, x + 1, static_cast<float>(1 + i % 3));
+        skewed.insert(box, i);
+        skewed_reference.insert(box, i);
+    }
+    assert(skewed.size() == SKEWED);
+    Rectangle skewed_world(-1, -1, SKEWED + 2, 10), skewed_window(5000, 1.5f, 5100, 2.5f);
+    assert(skewed.rangeQuery(skewed_world).size() == SKEWED);
+    assert(sorted(skewed.rangeQuery(skewed_window)) == sorted(skewed_reference.rangeQuery(skewed_window)));
+    for (int i = SKEWED; i < 2 * SKEWED; ++i) {  // past the starting capacity
+        skewed.insert(Rectangle(0, 0, 1, 1), i);
+    }
+    assert(skewed.size() == 2 * SKEWED && skewed.rangeQuery(skewed_world).size() == 2 * SKEWED);
+
+    LatchedRTree<int> small_latched(2);
+    small_latched.insert(Rectangle(0, 0, 1, 1), 1);
+    small_latched.insert(Rectangle(2, 2, 3, 3), 2);
+    small_latched.insert(Rectangle(4, 4, 5, 5), 3);  // grows the payload array
+    assert(small_latched.remove(Rectangle(0, 0, 1, 1), 1));
+    small_latched.insert(Rectangle(6, 6, 7, 7), 4);  // reuses the freed payload slot
+    assert(sorted(small_latched.rangeQuery(latched_world)) == std::vector<int>({2, 3, 4}));
+    std::cout << "Test 29 passed!" << std::endl;
+
+    // Test 30: Sharded index with Hilbert-range routing and rebalancing
+    ShardedRTree<int> sharded(4, Rectangle(0, 0, 100, 100));
+    RTree<int> unsharded;
+    std::vector<std::pair<Rectangle, int>> shard_batch;
+    for (int i = 0; i < 800; ++i) {
+        float x = static_cast<float>((i * 37) % 97), y = static_cast<float>((i * 53) % 89);
+        Rectangle box(x, y, x + 1.5f, y + 1.5f);
+        unsharded.insert(box, i);
+        if (i < 400) {
+            sharded.insert(box, i);
+        } else {
+            shard_batch.emplace_back(box, i);
+        }
+    }
+    sharded.insertBatch(shard_batch);
+    assert(sharded.size() == 800);
+    for (size_t count : sharded.shardSizes()) {  // equal Hilbert ranges are the four quadrants
+        assert(count > 150 && count < 250);
+    }
+    Rectangle shard_window(20, 30, 45, 60), corner_window(2, 2, 10, 10);
+    assert(sorted(sharded.rangeQuery(shard_window)) == sorted(unsharded.rangeQuery(shard_window)));
+    assert(sorted(sharded.rangeQuery(corner_window)) == sorted(unsharded.rangeQuery(corner_window)));
+    assert(sharded.shardsOverlapping(corner_window) == 1);
+    for (Point probe : {Point(0, 0), Point(50.3f, 49.7f), Point(99, 12)}) {
+        assert(sharded.nearest(probe, 7) == unsharded.nearest(probe, 7));
+    }
+    assert(sharded.remove(Rectangle(0, 0, 1.5f, 1.5f), 0));
+    assert(!sharded.remove(Rectangle(0, 0, 1.5f, 1.5f), 0));
+    assert(unsharded.remove(Rectangle(0, 0, 1.5f, 1.5f), 0));
+
+    for (int i = 0; i < 2400; ++i) {  // skewed load: everything new lands in one corner
+        float x = static_cast<float>(i % 40) * 0.5f, y = static_cast<float>(i / 40) * 0.3f;
+        Rectangle box(x, y, x + 0.2f, y + 0.2f);
+        sharded.insert(box, 1000 + i);
+        unsharded.insert(box, 1000 + i);
+    }
+    assert(!sharded.rebalanceIfSkewed(4.0));
+    assert(sharded.rebalanceIfSkewed(2.0) && sharded.rebalances() == 1);
+    assert(sharded.size() == unsharded.size());
+    for (size_t count : sharded.shardSizes()) {
+        assert(count > 750 && count < 850);
+    }
+    assert(!sharded.rebalanceIfSkewed(2.0));
+    Rectangle shard_world(-1, -1, 101, 101), hot_window(5, 5, 12, 9);
+    assert(sorted(sharded.rangeQuery(shard_world)) == sorted(unsharded.rangeQuery(shard_world)));
+    assert(sorted(sharded.rangeQuery(hot_window)) == sorted(unsharded.rangeQuery(hot_window)));
+    assert(sharded.nearest(Point(30, 30), 5) == unsharded.nearest(Point(30, 30), 5));
+    assert(sharded.remove(Rectangle(0.5f, 0, 0.7f, 0.2f), 1001));
+    assert(sharded.rangeQuery(Rectangle(0.55f, 0.05f, 0.6f, 0.1f)).empty());
+    std::cout << "Test 30 passed!" << std::endl;
+
+    // Test 31: Partitioned index over a loopback transport
+    LoopbackTransport<int> loopback(4);
+    PartitionedRTree<int> partitioned(loopback, Rectangle(0, 0, 100, 100));
+    RTree<int> gathered;
+    std::vector<std::pair<Rectangle, int>> partition_batch;
+    for (int i = 0; i < 600; ++i) {
+        float x = static_cast<float>((i * 41) % 101), y = static_cast<float>((i * 59) % 97);
+        Rectangle box(x, y, x + 1.25f, y + 0.75f);
+        gathered.insert(box, i);
+        if (i % 3 == 0) {
+            partitioned.insert(box, i);
+        } else {
+            partition_batch.emplace_back(box, i);
+        }
+    }
+    partitioned.insertBatch(partition_batch);
+    assert(partitioned.size() == 600);
+    for (size_t p = 0; p < loopback.partitions(); ++p) {
+        assert(loopback.server(p).size() > 100);
+    }
+    Rectangle partition_window(30, 10, 70, 55), partition_corner(80, 3, 95, 12);
+    assert(sorted(partitioned.rangeQuery(partition_window)) == sorted(gathered.rangeQuery(partition_window)));
+    uint64_t messages_before = loopback.messages();
+    assert(sorted(partitioned.rangeQuery(partition_corner)) == sorted(gathered.rangeQuery(partition_corner)));
+    assert(partitioned.partitionsOverlapping(partition_corner) == 1 && loopback.messages() == messages_before + 1);
+    for (Point probe : {Point(0, 0), Point(50, 50), Point(99.5f, 20), Point(-30, 140)}) {
+        assert(partitioned.nearest(probe, 6) == gathered.nearest(probe, 6));
+    }
+    messages_before = loopback.messages();
+    partitioned.nearest(Point(10, 10), 3);  // the nearest partition alone settles it
+    assert(loopback.messages() == messages_before + 1);
+    assert(partitioned.nearest(Point(10, 10), 1000).size() == 600);
+    assert(partitioned.remove(Rectangle(0, 0, 1.25f, 0.75f), 0));
+    assert(!partitioned.remove(Rectangle(0, 0, 1.25f, 0.75f), 0));
+    assert(partitioned.size() == 599 && partitioned.rangeQuery(Rectangle(0, 0, 0.5f, 0.5f)).empty());
+    bool truncated_rejected = false;
+    try {
+        loopback.call(0, std::string(1, static_cast<char>(PartitionOp::Insert)));
+    } catch (const std::out_of_range&) {
+        truncated_rejected = true;
+    }
+    assert(truncated_rejected);
+    MessageWriter oversized;  // claims far more records than it carries
+    oversized.put(PartitionOp::InsertBatch);
+    oversized.put<uint64_t>(uint64_t(1) << 60);
+    oversized.put(Rectangle(0, 0, 1, 1));
+    oversized.put(7);
+    bool oversized_rejected = false;
+    try {
+        loopback.call(0, oversized.bytes);
+    } catch (const std::out_of_range&) {
+        oversized_rejected = true;
+    }
+    assert(oversized_rejected && partitioned.rangeQuery(Rectangle(0, 0, 1, 1)).size() == 0);
+
+    LoopbackTransport<int, Point> point_loopback(3);
+    PartitionedRTree<int, Point> point_partitions(point_loopback, Rectangle(0, 0, 10, 10));
+    for (int i = 0; i < 100; ++i) {
+        point_partitions.insert(Point(static_cast<float>(i % 10), static_cast<float>(i / 10)), i);
+    }
+    assert(point_partitions.rangeQuery(Rectangle(2, 2, 4, 3)).size() == 6);  // closed boundaries
+    assert(point_partitions.nearest(Point(7.1f, 3.2f), 1) == std::vector<int>{37});
+    std::cout << "Test 31 passed!" << std::endl;
+    std::cout << "All tests passed!" << std::endl;
+}
+
+// Times random window queries against a tree of random boxes in insertion
+// order and again after each relayout.
+void benchRelayout(size_t entry_count, size_t query_count) {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+    RTree<uint32_t> rtree;
+    for (size_t i = 0; i < entry_count; ++i) {
+        float x = coord(rng), y = coord(rng);
+        rtree.insert(Rectangle(x, y, x + 0.1f, y + 0.1f), static_cast<uint32_t>(i));
+    }
+
+    std::vector<Rectangle> queries;
+    for (size_t i = 0; i < query_count; ++i) {
+        float x = coord(rng), y = coord(rng);
+        queries.emplace_back(x, y, x + 1.0f, y + 1.0f);
+    }
+
+    auto timeQueries = [&](const char* layout) {
+        auto start = std::chrono::steady_clock::now();
+        size_t hits = 0;
+        for (const auto& query : queries) {
+            hits += rtree.rangeQuery(query).size();
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "layout=" << layout << " entries=" << entry_count << " nodes=" << rtree.nodes.size()
+                  << " ns_per_query=" << elapsed.count() / static_cast<double>(query_count)
+                  << " hits=" << hits << std::endl;
+    };
+
+    timeQueries("insertion");
+    rtree.relayout(NodeLayout::BreadthFirst);
+    timeQueries("bfs");
+    rtree.relayout(NodeLayout::VanEmdeBoas);
+    timeQueries("veb");
+}
+
+// Synthetic datasets for the benchmark suite, all inside a 1000 x 1000
+// world:
+//   uniform  - small boxes scattered uniformly
+//   gaussian - boxes around 64 Gaussian cluster centres
+//   zipf     - uniform within 32 x 32 grid cells picked with Zipf(1.1) weights
+//   tiger    - thin segment boxes along random mostly axis-aligned polylines,
+//              resembling TIGER road networks
+std::vector<Rectangle> makeDataset(const std::string& kind, size_t count, uint32_t seed) {
+    constexpr float WORLD = 1000.0f;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> coord(0.0f, WORLD);
+    auto clamp = [&](float v) { return std::min(std::max(v, 0.0f), WORLD); };
+
+    std::vector<Rectangle> boxes;
+    boxes.reserve(count);
+    if (kind == "uniform") {
+        std::uniform_real_distribution<float> side(0.0f, 0.5f);
+        while (boxes.size() < count) {
+            float x = coord(rng), y = coord(rng);
+            boxes.emplace_back(x, y, x + side(rng), y + side(rng));
+        }
+    } else if (kind == "gaussian") {
+        std::vector<Point> centers;
+        std::uniform_real_distribution<float> center(100.0f, WORLD - 100.0f);
+        for (int i = 0; i < 64; ++i) {
+            centers.emplace_back(center(rng), center(rng));
+        }
+        std::uniform_int_distribution<size_t> pick(0, centers.size() - 1);
+        std::normal_distribution<float> offset(0.0f, 15.0f);
+        while (boxes.size() < count) {
+            const Point& c = centers[pick(rng)];
+            float x = clamp(c.x + offset(rng)), y = clamp(c.y + offset(rng));
+            boxes.emplace_back(x, y, x + 0.2f, y + 0.2f);
+        }
+    } else if (kind == "zipf") {
+        constexpr int CELLS = 32;
+        constexpr float CELL = WORLD / CELLS;
+        std::vector<int> cells(CELLS * CELLS);
+        for (size_t i = 0; i < cells.size(); ++i) {
+            cells[i] = static_cast<int>(i);
+        }
+        std::shuffle(cells.begin(), cells.end(), rng);
+        std::vector<double> weights(cells.size());
+        for (size_t rank = 0; rank < weights.size(); ++rank) {
+            weights[rank] = 1.0 / std::pow(static_cast<double>(rank + 1), 1.1);
+        }
+        std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+        std::uniform_real_distribution<float> within(0.0f, CELL);
+        while (boxes.size() < count) {
+            int cell = cells[pick(rng)];
+            float x = (cell % CELLS) * CELL + within(rng);
+            float y = (cell / CELLS) * CELL + within(rng);
+            boxes.emplace_back(x, y, x + 0.1f, y + 0.1f);
+        }
+    } else if (kind == "tiger") {
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        std::exponential_distribution<float> length(2.0f);
+        std::normal_distribution<float> jitter(0.0f, 0.05f);
+        while (boxes.size() < count) {
+            float x = coord(rng), y = coord(rng);
+            float heading = static_cast<float>(static_cast<int>(unit(rng) * 4)) * 1.5707964f;
+            for (int segment = 0; segment < 64 && boxes.size() < count; ++segment) {
+                if (unit(rng) < 0.1f) {
+                    heading += unit(rng) < 0.5f ? 1.5707964f : -1.5707964f;
+                }
+                float step = length(rng);
+                float angle = heading + jitter(rng);
+                float nx = clamp(x + step * std::cos(angle)), ny = clamp(y + step * std::sin(angle));
+                boxes.emplace_back(std::min(x, nx), std::min(y, ny), std::max(x, nx), std::max(y, ny));
+                x = nx;
+                y = ny;
+            }
+        }
+    } else {
+        throw std::invalid_argument("Unknown dataset: " + kind);
+    }
+    return boxes;
+}
+
+// Peak resident set size of this process so far, in kilobytes.
+long peakRssKb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Nodes a rangeQuery() over `rect` opens, found by replaying its descent.
+template <typename TreeT>
+size_t countNodesVisited(const TreeT& rtree, uint32_t node_index, const Rectangle& rect) {
+    const auto& node = rtree.nodes[node_index];
+    size_t visited = 1;
+    if (!node.is_leaf) {
+        for (const auto& entry : node.branches()) {
+            if (entry.bounding_box.intersects(rect)) {
+                visited += countNodesVisited(rtree, entry.child_index, rect);
+            }
+        }
+    }
+    return visited;
+}
+
+// One result line, as a JSON object modelled on Google Benchmark's output.
+// nodes_visited is omitted (negative) where it is not measured.
+void reportBenchmark(const std::string& name, const std::string& dataset, size_t entries,
+                     size_t iterations, double elapsed_ns, double nodes_visited = -1.0) {
+    double ns_per_op = elapsed_ns / static_cast<double>(std::max<size_t>(iterations, 1));
+    std::cout << "{\"name\":\"" << name << "/" << dataset << "/" << entries << "\""
+              << ",\"dataset\":\"" << dataset << "\""
+              << ",\"entries\":" << entries
+              << ",\"iterations\":" << iterations
+              << ",\"real_time\":" << ns_per_op
+              << ",\"time_unit\":\"ns\""
+              << ",\"ops_per_sec\":" << (ns_per_op > 0 ? 1e9 / ns_per_op : 0.0);
+    if (nodes_visited >= 0) {
+        std::cout << ",\"nodes_visited\":" << nodes_visited;
+    }
+    std::cout << ",\"peak_rss_kb\":" << peakRssKb() << "}" << std::endl;
+}
+
+// Runs insert, bulk load, range queries at several selectivities, kNN and
+// delete for every dataset at sizes 10^3, 10^4, ... up to `max_entries`.
+// Output is one JSON object per line, for regression tracking.
+void runBenchmarks(size_t max_entries, size_t query_count) {
+    using Clock = std::chrono::steady_clock;
+    auto since = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    };
+
+    for (const std::string dataset : {"uniform", "gaussian", "zipf", "tiger"}) {
+        for (size_t entries = 1000; entries <= max_entries; entries *= 10) {
+            std::vector<Rectangle> boxes = makeDataset(dataset, entries, 7);
+            std::vector<std::pair<Rectangle, uint32_t>> items;
+            items.reserve(entries);
+            for (size_t i = 0; i < entries; ++i) {
+                items.emplace_back(boxes[i], static_cast<uint32_t>(i));
+            }
+
+            RTree<uint32_t> inserted;
+            auto start = Clock::now();
+            for (const auto& item : items) {
+                inserted.insert(item.first, item.second);
+            }
+            reportBenchmark("insert", dataset, entries, entries, since(start));
+
+            RTree<uint32_t> buffered;
+            start = Clock::now();
+            buffered.beginIngest();
+            for (const auto& item : items) {
+                buffered.insert(item.first, item.second);
+            }
+            buffered.endIngest();
+            reportBenchmark("insert_buffered", dataset, entries, entries, since(start));
+
+            RTree<uint32_t> packed;
+            start = Clock::now();
+            packed.bulkLoad(items);
+            reportBenchmark("bulk_load", dataset, entries, entries, since(start));
+
+            std::mt19937 rng(11);
+            std::uniform_int_distribution<size_t> pick(0, entries - 1);
+            for (double selectivity : {0.00001, 0.0001, 0.001, 0.01}) {
+                float half_side = 500.0f * static_cast<float>(std::sqrt(selectivity));
+                std::vector<Rectangle> queries;
+                for (size_t i = 0; i < query_count; ++i) {
+                    const Rectangle& anchor = boxes[pick(rng)];
+                    queries.emplace_back(anchor.x_min - half_side, anchor.y_min - half_side,
+                                         anchor.x_min + half_side, anchor.y_min + half_side);
+                }
+
+                start = Clock::now();
+                for (const auto& query : queries) {
+                    packed.rangeQuery(query);
+                }
+                double elapsed = since(start);
+
+                size_t visited = 0;
+                for (const auto& query : queries) {
+                    visited += countNodesVisited(packed, packed.root_index, query);
+                }
+                std::ostringstream name;
+                name << "range_query/sel:" << selectivity;
+                reportBenchmark(name.str(), dataset, entries, query_count, elapsed,
+                                static_cast<double>(visited) / static_cast<double>(query_count));
+            }
+
+            start = Clock::now();
+            for (size_t i = 0; i < query_count; ++i) {
+                const Rectangle& anchor = boxes[pick(rng)];
+                packed.nearest(Point(anchor.x_min, anchor.y_min), 10);
+            }
+            reportBenchmark("knn/k:10", dataset, entries, query_count, since(start));
+
+            size_t delete_count = std::min(entries, query_count);
+            start = Clock::now();
+            for (size_t i = 0; i < delete_count; ++i) {
+                inserted.remove(items[i].first, items[i].second);
+            }
+            reportBenchmark("delete", dataset, entries, delete_count, since(start));
+        }
+    }
+}
+
+// Inserts batches of 10^2, 10^3, ... up to `max_batch` uniform entries into
+// a tree already holding `base_entries`, once by looping insert() and once
+// with insertBatch(). Same JSON line format as runBenchmarks.
+void benchInsertBatch(size_t base_entries, size_t max_batch) {
+    using Clock = std::chrono::steady_clock;
+    auto since = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    };
+
+    std::vector<Rectangle> base = makeDataset("uniform", base_entries, 7);
+    std::vector<std::pair<Rectangle, uint32_t>> base_items;
+    base_items.reserve(base_entries);
+    for (size_t i = 0; i < base_entries; ++i) {
+        base_items.emplace_back(base[i], static_cast<uint32_t>(i));
+    }
+    RTree<uint32_t> seeded;
+    seeded.bulkLoad(base_items);
+
+    for (size_t batch_size = 100; batch_size <= max_batch; batch_size *= 10) {
+        std::vector<Rectangle> boxes = makeDataset("uniform", batch_size, 13);
+        std::vector<std::pair<Rectangle, uint32_t>> batch;
+        batch.reserve(batch_size);
+        for (size_t i = 0; i < batch_size; ++i) {
+            batch.emplace_back(boxes[i], static_cast<uint32_t>(base_entries + i));
+        }
+
+        RTree<uint32_t> looped = seeded;
+        auto start = Clock::now();
+        for (const auto& item : batch) {
+            looped.insert(item.first, item.second);
+        }
+        reportBenchmark("insert_loop", "uniform", batch_size, batch_size, since(start));
+
+        RTree<uint32_t> batched = seeded;
+        start = Clock::now();
+        batched.insertBatch(batch);
+        reportBenchmark("insert_batch", "uniform", batch_size, batch_size, since(start));
+    }
+}
+
+// All-k-nearest-neighbours over uniform points: a nearest() call per point
+// against allNearest() on one worker and on every core, then the reverse
+// index built from the same search and queried at random sites.
+void benchAllNearest(size_t entry_count, size_t k) {
+    using Clock = std::chrono::steady_clock;
+    auto since = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    };
+
+    std::vector<Rectangle> boxes = makeDataset("uniform", entry_count, 7);
+    std::vector<std::pair<Point, uint32_t>> items;
+    items.reserve(entry_count);
+    for (size_t i = 0; i < entry_count; ++i) {
+        items.emplace_back(Point(boxes[i].x_min, boxes[i].y_min), static_cast<uint32_t>(i));
+    }
+    PointRTree<uint32_t> tree;
+    tree.bulkLoad(items);
+
+    auto start = Clock::now();
+    size_t found = 0;
+    for (const auto& item : items) {
+        found += tree.nearest(item.first, k + 1).size();  // the point itself comes first
+    }
+    reportBenchmark("aknn_loop", "uniform", entry_count, entry_count, since(start));
+
+    start = Clock::now();
+    found += tree.allNearest(k, 1).size();
+    reportBenchmark("aknn_batch", "uniform", entry_count, entry_count, since(start));
+
+    start = Clock::now();
+    found += tree.allNearest(k).size();
+    reportBenchmark("aknn_parallel", "uniform", entry_count, entry_count, since(start));
+
+    start = Clock::now();
+    auto reverse_index = tree.reverseNearestIndex(k);
+    reportBenchmark("rknn_build", "uniform", entry_count, entry_count, since(start));
+
+    std::vector<Point> sites;
+    for (const auto& box : makeDataset("uniform", 10000, 13)) {
+        sites.emplace_back(box.x_min, box.y_min);
+    }
+    start = Clock::now();
+    for (const auto& hits : reverse_index.query(sites)) {
+        found += hits.size();
+    }
+    reportBenchmark("rknn_query", "uniform", entry_count, sites.size(), since(start));
+    if (found == 0) {
+        std::cerr << "no neighbours found" << std::endl;
+    }
+}
+
+// Mixed read/write throughput across thread counts: LatchedRTree against
+// an RTree behind one global reader-writer lock. Each thread runs
+// `ops_per_thread` operations on a tree prefilled with `entries` uniform
+// boxes. Each operation is a 0.01% window query, or with the given
+// probability an insert. Reported time is per operation over all threads.
+void benchConcurrency(size_t entries, size_t ops_per_thread) {
+    using Clock = std::chrono::steady_clock;
+    std::vector<Rectangle> boxes = makeDataset("uniform", entries + 8 * ops_per_thread, 7);
+
+    auto run = [&](auto& tree, auto insert, auto query, const std::string& name, int read_percent, size_t threads) {
+        std::atomic<size_t> next_box(entries);
+        std::vector<std::thread> workers;
+        auto start = Clock::now();
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                std::mt19937 rng(static_cast<uint32_t>(t));
+                std::uniform_int_distribution<int> percent(0, 99);
+                std::uniform_real_distribution<float> corner(0.0f, 990.0f);
+                for (size_t i = 0; i < ops_per_thread; ++i) {
+                    if (percent(rng) < read_percent) {
+                        float x = corner(rng), y = corner(rng);
+                        query(tree, Rectangle(x, y, x + 10, y + 10));
+                    } else {
+                        size_t index = next_box++ % boxes.size();
+                        insert(tree, boxes[index], static_cast<uint32_t>(index));
+                    }
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        std::ostringstream label;
+        label << name << "/read:" << read_percent << "/threads:" << threads;
+        reportBenchmark(label.str(), "uniform", entries, threads * ops_per_thread, elapsed);
+    };
+
+    struct LockedTree {
+        RTree<uint32_t> tree;
+        mutable std::shared_mutex lock;
+    };
+    for (int read_percent : {95, 50}) {
+        for (size_t threads : {1, 2, 4, 8}) {
+            LockedTree locked;
+            LatchedRTree<uint32_t> latched(entries + threads * ops_per_thread);
+            for (size_t i = 0; i < entries; ++i) {
+                locked.tree.insert(boxes[i], static_cast<uint32_t>(i));
+                latched.insert(boxes[i], static_cast<uint32_t>(i));
+            }
+            run(locked,
+                [](LockedTree& target, const Rectangle& box, uint32_t id) {
+                    std::unique_lock<std::shared_mutex> lock(target.lock);
+                    target.tree.insert(box, id);
+                },
+                [](const LockedTree& target, const Rectangle& window) {
+                    std::shared_lock<std::shared_mutex> lock(target.lock);
+                    return target.tree.rangeQuery(window).size();
+                },
+                "mixed_global_lock", read_percent, threads);
+            run(latched,
+                [](LatchedRTree<uint32_t>& target, const Rectangle& box, uint32_t id) { target.insert(box, id); },
+                [](const LatchedRTree<uint32_t>& target, const Rectangle& window) {
+                    return target.rangeQuery(window).size();
+                },
+                "mixed_latched", read_percent, threads);
+        }
+    }
+}
+
+// Ingest and query cost of ShardedRTree by shard count. Each run inserts
+// `entries` boxes in batches of `batch_size` with one worker per shard,
+// against a single RTree taking the same batches. The zipf dataset then
+// shows window query cost before and after rebalance() evens out the
+// shards.
+void benchSharded(size_t entries, size_t batch_size) {
+    using Clock = std::chrono::steady_clock;
+    auto since = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    };
+    const Rectangle world(0, 0, 1000, 1000);
+    batch_size = std::max<size_t>(batch_size, 1);
+
+    for (const std::string dataset : {"uniform", "zipf"}) {
+        std::vector<Rectangle> boxes = makeDataset(dataset, entries, 7);
+        std::vector<std::vector<std::pair<Rectangle, uint32_t>>> batches;
+        for (size_t i = 0; i < entries; ++i) {
+            if (i % batch_size == 0) {
+                batches.emplace_back();
+            }
+            batches.back().emplace_back(boxes[i], static_cast<uint32_t>(i));
+        }
+
+        RTree<uint32_t> single;
+        auto start = Clock::now();
+        for (const auto& batch : batches) {
+            single.insertBatch(batch);
+        }
+        reportBenchmark("shard_ingest/rtree", dataset, entries, entries, since(start));
+
+        std::vector<Rectangle> windows = makeDataset("uniform", 10000, 13);
+        for (auto& window : windows) {
+            window = Rectangle(window.x_min, window.y_min, window.x_min + 10, window.y_min + 10);
+        }
+        for (size_t shard_count : {1, 2, 4, 8}) {
+            ShardedRTree<uint32_t> sharded(shard_count, world);
+            start = Clock::now();
+            for (const auto& batch : batches) {
+                sharded.insertBatch(batch);
+            }
+            std::string name = "shard_ingest/shards:" + std::to_string(shard_count);
+            reportBenchmark(name, dataset, entries, entries, since(start));
+
+            auto timeQueries = [&](const std::string& label) {
+                size_t found = 0;
+                auto query_start = Clock::now();
+                for (const auto& window : windows) {
+                    found += sharded.rangeQuery(window).size();
+                }
+                reportBenchmark(label + "/shards:" + std::to_string(shard_count), dataset, entries,
+                                windows.size(), since(query_start));
+                return found;
+            };
+            size_t found = timeQueries("shard_query");
+            if (dataset == "zipf") {
+                start = Clock::now();
+                sharded.rebalance();
+                reportBenchmark("shard_rebalance/shards:" + std::to_string(shard_count), dataset, entries, 1,
+                                since(start));
+                if (timeQueries("shard_query_rebalanced") != found) {
+                    std::cerr << "rebalance changed query results" << std::endl;
+                }
+            }
+        }
+    }
+}
+
+// Selectivity estimates against true rangeQuery() counts on each dataset.
+// Besides the timing lines it prints one error line per selectivity: mean
+// relative error and mean / 95th-percentile q-error, the ratio of the larger
+// to the smaller of estimate and truth, both plus one so empty results
+// count.
+void benchEstimator(size_t entries, size_t query_count) {
+    using Clock = std::chrono::steady_clock;
+    auto since = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    };
+
+    for (const std::string dataset : {"uniform", "gaussian", "zipf", "tiger"}) {
+        std::vector<Rectangle> boxes = makeDataset(dataset, entries, 7);
+        std::vector<std::pair<Rectangle, uint32_t>> items;
+        items.reserve(entries);
+        for (size_t i = 0; i < entries; ++i) {
+            items.emplace_back(boxes[i], static_cast<uint32_t>(i));
+        }
+        RTree<uint32_t> tree;
+        tree.bulkLoad(items);
+
+        auto start = Clock::now();
+        auto estimator = tree.selectivityEstimator();
+        reportBenchmark("estimator_build", dataset, entries, 1, since(start));
+
+        std::mt19937 rng(11);
+        std::uniform_int_distribution<size_t> pick(0, entries - 1);
+        for (double selectivity : {0.0001, 0.001, 0.01, 0.1}) {
+            float half_side = 500.0f * static_cast<float>(std::sqrt(selectivity));
+            std::vector<Rectangle> queries;
+            for (size_t i = 0; i < query_count; ++i) {
+                const Rectangle& anchor = boxes[pick(rng)];
+                queries.emplace_back(anchor.x_min - half_side, anchor.y_min - half_side,
+                                     anchor.x_min + half_side, anchor.y_min + half_side);
+            }
+
+            std::vector<double> estimates;
+            start = Clock::now();
+            for (const auto& query : queries) {
+                estimates.push_back(estimator.estimateCount(query));
+            }
+            std::ostringstream name;
+            name << "estimate/sel:" << selectivity;
+            reportBenchmark(name.str(), dataset, entries, query_count, since(start));
+
+            std::vector<double> actual;
+            start = Clock::now();
+            for (const auto& query : queries) {
+                actual.push_back(static_cast<double>(tree.rangeQuery(query).size()));
+            }
+            name.str("");
+            name << "range_count/sel:" << selectivity;
+            reportBenchmark(name.str(), dataset, entries, query_count, since(start));
+
+            double relative_sum = 0.0, q_sum = 0.0;
+            std::vector<double> q_errors;
+            for (size_t i = 0; i < query_count; ++i) {
+                double estimate = estimates[i] + 1.0, truth = actual[i] + 1.0;
+                relative_sum += std::abs(estimate - truth) / truth;
+                q_errors.push_back(std::max(estimate, truth) / std::min(estimate, truth));
+                q_sum += q_errors.back();
+            }
+            std::sort(q_errors.begin(), q_errors.end());
+            std::cout << "{\"name\":\"estimate_error/sel:" << selectivity << "/" << dataset << "/" << entries << "\""
+                      << ",\"cells\":" << estimator.cells()
+                      << ",\"mean_relative_error\":" << relative_sum / static_cast<double>(query_count)
+                      << ",\"mean_q_error\":" << q_sum / static_cast<double>(query_count)
+                      << ",\"p95_q_error\":" << q_errors[q_errors.size() * 95 / 100] << "}" << std::endl;
+        }
+    }
+}
+
+// Builds a tree from a file with one "x_min y_min x_max y_max" (or "x y")
+// record per line, by repeated insert or with `bulk` by bulkLoad, and
+// prints its health report. Blank lines and lines starting with '#' are
+// skipped.
+int analyzeFile(const std::string& path, bool bulk) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Cannot open " << path << std::endl;
+        return 1;
+    }
+
+    std::vector<std::pair<Rectangle, uint32_t>> items;
+    std::string line;
+    for (size_t line_number = 1; std::getline(in, line); ++line_number) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::vector<float> values;
+        float value;
+        while (fields >> value) {
+            values.push_back(value);
+        }
+        if (values.size() == 2) {
+            values = {values[0], values[1], values[0], values[1]};
+        } else if (values.size() != 4) {
+            std::cerr << path << ":" << line_number << ": expected 2 or 4 numbers" << std::endl;
+            return 1;
+        }
+        items.emplace_back(Rectangle(values[0], values[1], values[2], values[3]),
+                           static_cast<uint32_t>(items.size()));
+    }
+
+    RTree<uint32_t> rtree;
+    if (bulk) {
+        rtree.bulkLoad(items);
+    } else {
+        for (const auto& item : items) {
+            rtree.insert(item.first, item.second);
+        }
+    }
+    std::cout << rtree.analyze();
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 2 && std::string(argv[1]) == "analyze") {
+        return analyzeFile(argv[2], argc > 3 && std::string(argv[3]) == "--bulk");
+    }
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        size_t max_entries = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        size_t query_count = argc > 3 ? std::stoul(argv[3]) : 1000;
+        runBenchmarks(max_entries, query_count);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "relayout-bench") {
+        size_t entry_count = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        size_t query_count = argc > 3 ? std::stoul(argv[3]) : 100000;
+        benchRelayout(entry_count, query_count);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "batch-bench") {
+        size_t base_entries = argc > 2 ? std::stoul(argv[2]) : 100000;
+        size_t max_batch = argc > 3 ? std::stoul(argv[3]) : 1000000;
+        benchInsertBatch(base_entries, max_batch);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "aknn-bench") {
+        size_t entry_count = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        size_t k = argc > 3 ? std::stoul(argv[3]) : 5;
+        benchAllNearest(entry_count, k);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "concurrency-bench") {
+        size_t entries = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        size_t ops_per_thread = argc > 3 ? std::stoul(argv[3]) : 100000;
+        benchConcurrency(entries, ops_per_thread);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "shard-bench") {
+        size_t entries = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        size_t batch_size = argc > 3 ? std::stoul(argv[3]) : 10000;
+        benchSharded(entries, batch_size);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "estimate-bench") {
+        size_t entries = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        size_t query_count = argc > 3 ? std::stoul(argv[3]) : 1000;
+        benchEstimator(entries, query_count);
+        return 0;
+    }
     runTests();
     return 0;
 }